@@ -1,6 +1,7 @@
 #ifndef IO_params_H_
 #define IO_params_H_
 
+#include <algorithm>
 #include <array>
 #include <cstring> 
 #include <cstdlib>
@@ -37,6 +38,25 @@ struct LatticeDataContainer { // Just the thing that holds all variables
   std::string save_config;
   int save_config_every_X_updates;
   std::string outpath;
+  // optional parameter, given as "key = value" lines after outpath
+  std::string field_backend;
+  std::string metropolis_kernel;
+  int threads;
+  std::string cluster_algorithm;
+  int measurement_queue;
+  std::string config_compression;
+  int keep_configs;
+  int chains;
+  std::vector<double> chain_kappa, chain_lambda; // lattice values, per chain
+  int swap_every_X_updates;
+  std::string autotune;
+  double target_acceptance;
+  int profile_every_X_updates;
+  std::vector<std::string> update_schedule; // steps of one iteration
+  int hmc_steps;
+  double hmc_trajectory_length;
+  std::string hmc_integrator;
+  double hmc_fourier_mass;
 };
 // -----------------------------------------------------------------------------
 // -----------------------------------------------------------------------------
@@ -44,6 +64,83 @@ class IO_params {
 
 private:
 
+  inline void read_optional(LatticeDataContainer& data, 
+                            const std::string& key, const char* value) {
+
+    if(key == "field_backend")
+      data.field_backend.assign(value);
+    else if(key == "metropolis_kernel")
+      data.metropolis_kernel.assign(value);
+    else if(key == "threads")
+      data.threads = atoi(value);
+    else if(key == "cluster_algorithm")
+      data.cluster_algorithm.assign(value);
+    else if(key == "measurement_queue")
+      data.measurement_queue = atoi(value);
+    else if(key == "config_compression")
+      data.config_compression.assign(value);
+    else if(key == "keep_configs")
+      data.keep_configs = atoi(value);
+    else if(key == "chains")
+      data.chains = atoi(value);
+    else if(key == "chain_kappa")
+      data.chain_kappa = read_list(value);
+    else if(key == "chain_lambda")
+      data.chain_lambda = read_list(value);
+    else if(key == "swap_every_X_updates")
+      data.swap_every_X_updates = atoi(value);
+    else if(key == "autotune")
+      data.autotune.assign(value);
+    else if(key == "target_acceptance")
+      data.target_acceptance = atof(value);
+    else if(key == "profile_every_X_updates")
+      data.profile_every_X_updates = atoi(value);
+    else if(key == "update_schedule")
+      data.update_schedule = read_names(value);
+    else if(key == "hmc_steps")
+      data.hmc_steps = atoi(value);
+    else if(key == "hmc_trajectory_length")
+      data.hmc_trajectory_length = atof(value);
+    else if(key == "hmc_integrator")
+      data.hmc_integrator.assign(value);
+    else if(key == "hmc_fourier_mass")
+      data.hmc_fourier_mass = atof(value);
+    else{
+      mdp << "Unknown parameter " << key << " in input file!" << endl;
+      exit(0);
+    }
+  };
+
+  // comma separated numbers
+  inline std::vector<double> read_list(const char* value) {
+    std::vector<double> list;
+    char* end = const_cast<char*>(value);
+    while(*end != '\0'){
+      list.push_back(strtod(end, &end));
+      if(*end == ',')
+        end++;
+      else if(*end != '\0'){
+        mdp << "Could not read the list " << value << endl;
+        exit(0);
+      }
+    }
+    return list;
+  };
+
+  // comma separated names
+  inline std::vector<std::string> read_names(const char* value) {
+    std::vector<std::string> names;
+    const char* begin = value;
+    for(const char* end = value; ; end++)
+      if(*end == ',' || *end == '\0'){
+        names.emplace_back(begin, end);
+        if(*end == '\0')
+          break;
+        begin = end + 1;
+      }
+    return names;
+  };
+
   inline LatticeDataContainer read_infile(int argc, char** argv) {
 
     int opt = -1;
@@ -83,6 +180,7 @@ private:
     data.formulation.assign(readin);
     reader += fscanf(infile, "kappa = %lf\n", &data.kappa);
     reader += fscanf(infile, "lambda = %lf\n", &data.lambda);
+    const double lambda_input = data.lambda;
 
     if(data.formulation == "continuum"){
       data.lambda = 4.*data.kappa*data.kappa*data.lambda;
@@ -119,6 +217,171 @@ private:
     reader += fscanf(infile, "outpath = %255s\n", readin);
     data.outpath.assign(readin);
 
+    // optional parameters - defaults first, then whatever the file provides
+    data.field_backend = "soa";
+    data.metropolis_kernel = "scalar";
+    data.threads = 1;
+    data.cluster_algorithm = "min_size";
+    data.measurement_queue = 2;
+    data.config_compression = "none";
+    data.keep_configs = 0;
+    data.chains = 1;
+    data.swap_every_X_updates = 0;
+    data.autotune = "no";
+    data.target_acceptance = 0.24;
+    data.profile_every_X_updates = 0;
+    data.update_schedule = {"metropolis", "cluster"};
+    data.hmc_steps = 10;
+    data.hmc_trajectory_length = 1.;
+    data.hmc_integrator = "omelyan";
+    data.hmc_fourier_mass = 0.;
+    // the rest line by line, "key = value" or empty, # starts a comment
+    char line[1024], key[256], rest[2];
+    while(fgets(line, sizeof(line), infile) != NULL){
+      line[strcspn(line, "#\r\n")] = '\0';
+      const char* begin = line + strspn(line, " \t");
+      if(*begin == '\0')
+        continue;
+      if(sscanf(begin, "%255s = %255s %1s", key, readin, rest) != 2){
+        mdp << "Could not read the line \"" << begin << "\" in " 
+            << infilename << "!" << endl;
+        exit(0);
+      }
+      read_optional(data, key, readin);
+    }
+    if(data.field_backend != "soa" && data.field_backend != "mdp"){
+      mdp << "field_backend must be soa or mdp!" << endl;
+      exit(0);
+    }
+    if(data.metropolis_kernel != "scalar" && data.metropolis_kernel != "avx2" &&
+       data.metropolis_kernel != "avx512"){
+      mdp << "metropolis_kernel must be scalar, avx2 or avx512!" << endl;
+      exit(0);
+    }
+    if(data.metropolis_kernel != "scalar" && data.field_backend != "soa"){
+      mdp << "vectorised Metropolis kernels need field_backend = soa!" << endl;
+      exit(0);
+    }
+    if(data.threads < 0){
+      mdp << "threads must not be negative!" << endl;
+      exit(0);
+    }
+    if(data.cluster_algorithm != "min_size" && 
+       data.cluster_algorithm != "swendsen_wang"){
+      mdp << "cluster_algorithm must be min_size or swendsen_wang!" << endl;
+      exit(0);
+    }
+    if(data.cluster_algorithm != "min_size" && data.field_backend != "soa"){
+      mdp << "swendsen_wang needs field_backend = soa!" << endl;
+      exit(0);
+    }
+    if(data.measurement_queue < 0){
+      mdp << "measurement_queue must not be negative!" << endl;
+      exit(0);
+    }
+    if(data.config_compression != "none" && data.config_compression != "fpc"){
+      mdp << "config_compression must be none or fpc!" << endl;
+      exit(0);
+    }
+    if(data.keep_configs < 0){
+      mdp << "keep_configs must not be negative!" << endl;
+      exit(0);
+    }
+    if(data.chains < 1){
+      mdp << "chains must be at least 1!" << endl;
+      exit(0);
+    }
+    if(data.chains > 1 && data.field_backend != "soa"){
+      mdp << "several chains need field_backend = soa!" << endl;
+      exit(0);
+    }
+    if(data.swap_every_X_updates < 0){
+      mdp << "swap_every_X_updates must not be negative!" << endl;
+      exit(0);
+    }
+    if(data.swap_every_X_updates > 0 && data.chains < 2){
+      mdp << "replica exchange needs at least two chains!" << endl;
+      exit(0);
+    }
+    if(data.autotune != "yes" && data.autotune != "no"){
+      mdp << "autotune must be yes or no!" << endl;
+      exit(0);
+    }
+    if(data.autotune == "yes" && data.field_backend != "soa"){
+      mdp << "autotune needs field_backend = soa!" << endl;
+      exit(0);
+    }
+    if(data.target_acceptance <= 0. || data.target_acceptance >= 1.){
+      mdp << "target_acceptance must be between 0 and 1!" << endl;
+      exit(0);
+    }
+    if(data.profile_every_X_updates < 0){
+      mdp << "profile_every_X_updates must not be negative!" << endl;
+      exit(0);
+    }
+    for(const auto& step : data.update_schedule){
+      if(step != "metropolis" && step != "overrelaxation" && 
+         step != "heatbath" && step != "hmc" && step != "cluster"){
+        mdp << "update_schedule must be a comma separated list of metropolis, "
+            << "overrelaxation, heatbath, hmc and cluster!" << endl;
+        exit(0);
+      }
+      if((step == "overrelaxation" || step == "heatbath" || step == "hmc") && 
+         data.field_backend != "soa"){
+        mdp << "overrelaxation, heatbath and hmc need field_backend = soa!" 
+            << endl;
+        exit(0);
+      }
+    }
+    if(data.hmc_steps < 1){
+      mdp << "hmc_steps must be at least 1!" << endl;
+      exit(0);
+    }
+    if(data.hmc_trajectory_length <= 0.){
+      mdp << "hmc_trajectory_length must be positive!" << endl;
+      exit(0);
+    }
+    if(data.hmc_integrator != "leapfrog" && data.hmc_integrator != "omelyan"){
+      mdp << "hmc_integrator must be leapfrog or omelyan!" << endl;
+      exit(0);
+    }
+    if(data.hmc_fourier_mass < 0.){
+      mdp << "hmc_fourier_mass must not be negative!" << endl;
+      exit(0);
+    }
+    if(data.hmc_fourier_mass > 0. && mdp.nproc() > 1){
+      mdp << "hmc_fourier_mass needs a single process!" << endl;
+      exit(0);
+    }
+    if(data.autotune == "yes" && 
+       (std::count(data.update_schedule.begin(), data.update_schedule.end(),
+                   "metropolis") == 0 ||
+        std::count(data.update_schedule.begin(), data.update_schedule.end(),
+                   "cluster") == 0)){
+      mdp << "autotune needs metropolis and cluster in update_schedule!" << endl;
+      exit(0);
+    }
+    // couplings of the chains, given in the formulation of kappa and lambda
+    if(data.chain_kappa.empty())
+      data.chain_kappa.assign(data.chains, data.kappa);
+    if(data.chain_lambda.empty())
+      data.chain_lambda.assign(data.chains, lambda_input);
+    if(data.chain_kappa.size() != size_t(data.chains) ||
+       data.chain_lambda.size() != size_t(data.chains)){
+      mdp << "chain_kappa and chain_lambda need one value per chain!" << endl;
+      exit(0);
+    }
+    if(data.formulation == "continuum")
+      for(size_t k = 0; k < size_t(data.chains); k++)
+        data.chain_lambda[k] = 4.*data.chain_kappa[k]*data.chain_kappa[k]*
+                               data.chain_lambda[k];
+    if(data.cluster_algorithm == "min_size" && data.field_backend == "soa" &&
+       mdp.nproc() > 1){
+      mdp << "min_size clusters do not grow across processes, use "
+          << "cluster_algorithm = swendsen_wang with several processes!" << endl;
+      exit(0);
+    }
+
     // close input file
     fclose(infile);
 
@@ -130,6 +393,15 @@ public:
   
   IO_params(int argc, char** argv) : data(read_infile(argc, argv)) {};
 
+  // the parameters of chain k: its couplings and replica + k
+  inline LatticeDataContainer chain(const size_t k) const {
+    LatticeDataContainer c = data;
+    c.kappa = data.chain_kappa[k];
+    c.lambda = data.chain_lambda[k];
+    c.replica = data.replica + k;
+    return c;
+  };
+
 }; // end of class definition
 
 } // end of namespace
@@ -0,0 +1,117 @@
+#ifndef AUTOCORRELATION_H_
+#define AUTOCORRELATION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace cluster {
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// integrated autocorrelation time of the series x, 1/2 for uncorrelated data.
+// The sum over the normalised autocorrelation function is cut at the first
+// window W >= c tau_int(W) (Madras and Sokal, J. Stat. Phys. 50, 1988)
+inline double integrated_autocorrelation_time(const std::vector<double>& x,
+                                              const double c = 6.){
+
+  const size_t n = x.size();
+  if(n < 2)
+    return .5;
+  double mean = 0.;
+  for(const auto& v : x)
+    mean += v;
+  mean /= n;
+  double gamma0 = 0.;
+  for(const auto& v : x)
+    gamma0 += (v - mean)*(v - mean);
+  gamma0 /= n;
+  if(gamma0 <= 0.)
+    return .5;
+
+  double tau = .5;
+  for(size_t W = 1; W < n; W++){
+    double gamma = 0.;
+    for(size_t i = 0; i + W < n; i++)
+      gamma += (x[i] - mean)*(x[i+W] - mean);
+    tau += gamma/(n - W)/gamma0;
+    if(W >= c*tau)
+      break;
+  }
+  return std::max(tau, .5);
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Streaming estimate of the integrated autocorrelation time of a series by
+// hierarchical binning. Level l keeps the running mean and variance of the
+// means of blocks of 2^l consecutive values and the first half of the block
+// it is filling, so the memory grows with log2 of the number of values. Once
+// the blocks are much longer than tau_int, the variance of the block means
+// is 2 tau_int var(x)/2^l; the estimate is taken from the longest blocks of
+// which there are at least min_blocks.
+class BinningAnalysis {
+
+public:
+  BinningAnalysis(const size_t min_blocks = 64) : min_blocks(min_blocks) {};
+
+  inline void add(double x) {
+    for(size_t l = 0; ; l++){
+      if(l == levels.size())
+        levels.emplace_back();
+      level_t& level = levels[l];
+      // Welford update of mean and sum of squared deviations
+      level.n++;
+      const double d = x - level.mean;
+      level.mean += d/level.n;
+      level.m2 += d*(x - level.mean);
+      if(!level.half){
+        level.half = true;
+        level.first = x;
+        return;
+      }
+      level.half = false;
+      x = .5*(level.first + x); // a complete block for the next level
+    }
+  };
+
+  inline size_t size() const { return levels.empty() ? 0 : levels[0].n; };
+  inline double mean() const { return levels.empty() ? 0. : levels[0].mean; };
+  inline double tau_int() const {
+    if(size() < 2)
+      return .5;
+    const double var = variance(0);
+    if(var <= 0.)
+      return .5;
+    double tau = .5;
+    for(size_t l = 1; l < levels.size() && levels[l].n >= min_blocks; l++)
+      tau = .5*double(size_t(1) << l)*variance(l)/var;
+    return std::max(tau, .5);
+  };
+  // number of independent samples the series is worth
+  inline double effective_samples() const { return size()/(2.*tau_int()); };
+  // statistical error of the mean including the autocorrelation
+  inline double error() const {
+    return size() < 2 ? 0. : sqrt(variance(0)/effective_samples());
+  };
+
+private:
+  struct level_t {
+    size_t n = 0;
+    double mean = 0., m2 = 0., first = 0.;
+    bool half = false;
+  };
+
+  inline double variance(const size_t l) const {
+    return levels[l].n > 1 ? levels[l].m2/(levels[l].n - 1) : 0.;
+  };
+
+  const size_t min_blocks;
+  std::vector<level_t> levels;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // AUTOCORRELATION_H_
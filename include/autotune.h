@@ -0,0 +1,207 @@
+#ifndef AUTOTUNE_H_
+#define AUTOTUNE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mdp.h"
+#include "autocorrelation.h"
+
+namespace cluster {
+
+// Tunes the update parameters during the thermalisation sweeps of a run, then
+// freezes them:
+//
+//   1. metropolis_delta: the first fifth of the sweeps (at least 20) adapt
+//      delta by a Robbins-Monro step delta *= exp(2(acc - target)/sqrt(1+i))
+//      towards the target acceptance rate, averaged over the chains.
+//   2. metropolis_local_hits, then cluster_hits: every candidate runs an
+//      equal share of the remaining sweeps and is rated by the integrated
+//      autocorrelation time of |M| times the wall clock seconds per sweep,
+//      i.e. the cost of one independent measurement. The local hits are
+//      scanned with cluster_hits as given, the cluster hits with the best
+//      local hits.
+//
+// With fewer than 20 sweeps per candidate only delta is tuned. All inputs of
+// the decisions are summed over the processes by the caller, so every
+// process takes the same values.
+class AutoTuner {
+
+public:
+  AutoTuner(const int sweeps, const double delta, const int local_hits,
+            const int cluster_hits, const double target) :
+                        target(target), current_delta(delta),
+                        current_local(local_hits),
+                        current_cluster(cluster_hits), iteration(0),
+                        candidate(0) {
+    delta_sweeps = std::min(sweeps, std::max(20, sweeps/5));
+    for(const int hits : {1, 2, 5, 10, 20})
+      local_candidates.push_back(hits);
+    for(const int hits : {1, 2, 4, 8})
+      cluster_candidates.push_back(hits);
+    const int nb_candidates = local_candidates.size() +
+                              cluster_candidates.size();
+    candidate_sweeps = (sweeps - delta_sweeps)/nb_candidates;
+    if(candidate_sweeps < 20)
+      candidate_sweeps = 0; // too short, only delta
+    stage = (sweeps > 0) ? DELTA : DONE;
+  };
+
+  inline bool tuning() const { return stage != DONE; };
+  inline double delta() const { return current_delta; };
+  inline int local_hits() const { return current_local; };
+  inline int cluster_hits() const { return current_cluster; };
+
+  // the results of one sweep: the acceptance rate and |M|/V of every chain
+  // and the wall clock seconds of the updates
+  inline void update(const std::vector<double>& acc,
+                     const std::vector<double>& mag, const double seconds) {
+    if(stage == DONE)
+      return;
+    if(stage == DELTA){
+      double mean = 0.;
+      for(const auto& a : acc)
+        mean += a;
+      mean /= acc.size();
+      current_delta *= exp(2.*(mean - target)/sqrt(1. + iteration));
+      if(++iteration == delta_sweeps){
+        log << "\tautotune: metropolis_delta = " << current_delta << " after "
+            << delta_sweeps << " sweeps, acceptance " << mean << endl;
+        if(candidate_sweeps == 0)
+          log << "\tautotune: too few sweeps to tune the hits" << endl;
+        next_candidate();
+      }
+      return;
+    }
+    // hits: skip the first sweeps after a change, then collect
+    const int n = iteration++ - start;
+    if(n >= skip){
+      if(series.size() < mag.size())
+        series.resize(mag.size());
+      for(size_t k = 0; k < mag.size(); k++)
+        series[k].push_back(mag[k]);
+      time += seconds;
+    }
+    if(n + 1 == candidate_sweeps)
+      rate_candidate();
+  };
+
+  // what was tuned, for the log
+  inline std::string summary() const {
+    std::ostringstream s;
+    s << log.str() << "\tautotune: metropolis_delta = " << current_delta
+      << ", metropolis_local_hits = " << current_local
+      << ", cluster_hits = " << current_cluster;
+    return s.str();
+  };
+  // the tuned values as input file lines, written by process 0, so a
+  // restart continues with them
+  inline void write(const std::string& filename) const {
+    if(mdp.me() != 0)
+      return;
+    FILE* f = fopen(filename.c_str(), "w");
+    if(f == NULL){
+      std::cerr << "Could not write " << filename << endl;
+      return;
+    }
+    fprintf(f, "metropolis_delta = %.17g\nmetropolis_local_hits = %d\n"
+               "cluster_hits = %d\n", current_delta, current_local,
+               current_cluster);
+    fclose(f);
+  };
+  inline bool read(const std::string& filename) {
+    FILE* f = fopen(filename.c_str(), "r");
+    if(f == NULL)
+      return false;
+    // the tuner is only frozen with all three values
+    double delta;
+    int local, cluster;
+    int reader = 0;
+    reader += fscanf(f, "metropolis_delta = %lf\n", &delta);
+    reader += fscanf(f, "metropolis_local_hits = %d\n", &local);
+    reader += fscanf(f, "cluster_hits = %d\n", &cluster);
+    fclose(f);
+    if(reader != 3)
+      return false;
+    current_delta = delta;
+    current_local = local;
+    current_cluster = cluster;
+    stage = DONE;
+    return true;
+  };
+
+private:
+  typedef enum stage_t { DELTA=0, LOCAL_HITS, CLUSTER_HITS, DONE } stage_t;
+
+  // sets the hits of the next candidate or freezes everything
+  inline void next_candidate() {
+    if(candidate_sweeps == 0){
+      stage = DONE;
+      return;
+    }
+    if(candidate < local_candidates.size()){
+      stage = LOCAL_HITS;
+      current_local = local_candidates[candidate];
+    }
+    else if(candidate < local_candidates.size() + cluster_candidates.size()){
+      stage = CLUSTER_HITS;
+      if(candidate == local_candidates.size()) // best local hits found
+        current_local = best_local;
+      current_cluster = cluster_candidates[candidate - local_candidates.size()];
+    }
+    else{
+      current_cluster = best_cluster;
+      stage = DONE;
+      return;
+    }
+    start = iteration;
+    series.clear();
+    time = 0.;
+  };
+  // integrated autocorrelation time of |M| averaged over the chains times
+  // the wall clock time per sweep
+  inline void rate_candidate() {
+    double tau = 0.;
+    for(const auto& s : series)
+      tau += integrated_autocorrelation_time(s);
+    tau /= series.size();
+    const double per_sweep = time/series[0].size();
+    const double cost = 2.*tau*per_sweep;
+    log << "\tautotune: local hits " << current_local << ", cluster hits "
+        << current_cluster << ": tau_int(|M|) = " << tau << ", "
+        << per_sweep << " s per sweep, " << cost
+        << " s per independent measurement" << endl;
+    if(candidate == 0 || candidate == local_candidates.size() ||
+       cost < best_cost){
+      best_cost = cost;
+      if(stage == LOCAL_HITS)
+        best_local = current_local;
+      else
+        best_cluster = current_cluster;
+    }
+    candidate++;
+    next_candidate();
+  };
+
+  const double target;
+  double current_delta;
+  int current_local, current_cluster;
+  int delta_sweeps, candidate_sweeps, iteration, start = 0;
+  const int skip = 2; // sweeps after a change of the hits
+  size_t candidate;
+  stage_t stage;
+  std::vector<int> local_candidates, cluster_candidates;
+  std::vector<std::vector<double> > series;
+  double time = 0., best_cost = 0.;
+  int best_local = 0, best_cluster = 0;
+  std::ostringstream log;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // AUTOTUNE_H_
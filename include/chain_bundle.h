@@ -0,0 +1,252 @@
+#ifndef CHAIN_BUNDLE_H_
+#define CHAIN_BUNDLE_H_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "instrumentation.h"
+#include "metropolis_simd.h"
+#include "phi_field.h"
+#include "random_streams.h"
+
+namespace cluster {
+
+// Several independent Markov chains on the same lattice - replicas or
+// different couplings - evolved together by one process. The chains share
+// the geometry of one PhiField (site order, neighbour table, halo) and are
+// interleaved site by site: component c of chain k at site x is
+// comp[c][x*size() + k]. The Metropolis sweep runs all chains in lockstep,
+// one SIMD lane per chain at the same site, so the site and its neighbours
+// are contiguous vector loads without any gather. The kernels are the ones
+// of a single field, metropolis_site on view(k) and metropolis_chunk on
+// ChainLanes.
+//
+// Every chain draws from its own RandomStreams and has its own couplings, a
+// chain goes through the same updates and random numbers as a single-chain
+// run with its seed, replica, kappa and lambda and the same kernel.
+//
+// Cluster updates, measurements and checkpoints work on one chain at a time:
+// store(k) copies chain k into the PhiField the bundle was built on, load(k)
+// takes it back, together with the running sums.
+class ChainBundle {
+
+public:
+  ChainBundle(PhiField& phi, const size_t nb_chains) :
+                              phi(phi), nb_chains(nb_chains), sums(nb_chains) {
+    for(auto& c : comp)
+      c.resize(phi.nvol()*nb_chains);
+  };
+
+  inline size_t size() const { return nb_chains; };
+  // the field the chains share their geometry with
+  inline const PhiField& geometry() const { return phi; };
+
+  // component comp of all sites and chains
+  inline real_t* operator[](const size_t comp) { return this->comp[comp].data(); };
+  inline const real_t* operator[](const size_t comp) const {
+    return this->comp[comp].data();
+  };
+  inline PhiField::site_t site(const size_t x, const size_t k) const {
+    const size_t i = x*nb_chains + k;
+    return {{comp[0][i], comp[1][i], comp[2][i], comp[3][i]}};
+  };
+  // chain k for the update kernels
+  inline FieldView view(const size_t k) {
+    return {{{comp[0].data(), comp[1].data(), comp[2].data(), comp[3].data()}},
+            nb_chains, k};
+  };
+
+  // running sums of chain k over the local sites
+  inline const FieldSums& local_sums(const size_t k) const { return sums[k]; };
+  inline void add_to_sums(const size_t k, const FieldSums& change) {
+    sums[k] += change;
+  };
+
+  // chain k from the PhiField, all sites and the running sums
+  inline void load(const size_t k) {
+    for(size_t c = 0; c < 4; c++)
+      for(size_t x = 0; x < phi.nvol(); x++)
+        comp[c][x*nb_chains + k] = phi[c][x];
+    sums[k] = phi.local_sums();
+  };
+  // chain k into the PhiField
+  inline void store(const size_t k) const {
+    for(size_t c = 0; c < 4; c++)
+      for(size_t x = 0; x < phi.nvol(); x++)
+        phi[c][x] = comp[c][x*nb_chains + k];
+    phi.set_local_sums(sums[k]);
+  };
+  // communicate the boundaries of all chains after sites of one parity were
+  // changed, chain by chain through the PhiField, which is overwritten
+  inline void update(const int parity) {
+    if(mdp.nproc() == 1)
+      return;
+    for(size_t k = 0; k < nb_chains; k++){
+      for(size_t c = 0; c < 4; c++)
+        for(size_t x = phi.begin(parity); x < phi.end(parity); x++)
+          phi[c][x] = comp[c][x*nb_chains + k];
+      phi.update(parity);
+      for(size_t c = 0; c < 4; c++)
+        for(size_t x = phi.local_volume(); x < phi.nvol(); x++)
+          comp[c][x*nb_chains + k] = phi[c][x];
+    }
+  };
+
+private:
+  PhiField& phi;
+  const size_t nb_chains;
+  std::array<std::vector<real_t>, 4> comp;
+  std::vector<FieldSums> sums;
+
+}; // end of class definition
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the lanes of metropolis_chunk: the chains [k, k+width) at the local site x,
+// every chain has its own FieldSums
+template<class S>
+struct ChainLanes {
+  ChainBundle& chains;
+  const size_t x, k;
+  FieldSums* const sums;
+
+  inline typename S::vec load(const size_t comp) const {
+    return S::load(chains[comp] + x*chains.size() + k);
+  };
+  inline void store(const size_t comp, const typename S::vec a) const {
+    S::store(chains[comp] + x*chains.size() + k, a);
+  };
+  // the same neighbour in every lane, a contiguous load
+  inline typename S::vec neighbour(const size_t comp, const size_t dir) const {
+    return S::load(chains[comp] +
+                   chains.geometry().neighbour(dir, x)*chains.size() + k);
+  };
+  inline PhiField::site_t site(const size_t lane) const {
+    return chains.site(x, k + lane);
+  };
+  inline FieldSums& change(const size_t lane) const { return sums[lane]; };
+};
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// all chains at the local site x which fill whole vectors, adds the accepted
+// hits of every chain to acc and returns the number of updated chains
+template<class S>
+inline size_t metropolis_site_lanes(ChainBundle& chains, const size_t x,
+                                    const uint32_t* k0, const uint32_t* k1,
+                                    const uint64_t* step,
+                                    const std::vector<double>& kappa,
+                                    const std::vector<double>& lambda,
+                                    const double delta,
+                                    const size_t nb_of_hits,
+                                    std::vector<double>& rnd,
+                                    FieldSums* change, double* acc){
+
+  rnd.resize(8*nb_of_hits*S::width);
+  uint32_t site[S::width];
+  std::fill(site, site + S::width, chains.geometry().global_index(x));
+  double accepted[S::width];
+  size_t k = 0;
+  for(; k + S::width <= chains.size(); k += S::width){
+    philox_fill_lanes<S::width>(k0 + k, k1 + k, site, step + k, rnd.data(),
+                                8*nb_of_hits);
+    S::store(accepted, metropolis_chunk<S>(
+                         ChainLanes<S>{chains, x, k, change + k}, rnd.data(),
+                         S::load(kappa.data() + k), S::load(lambda.data() + k),
+                         delta, nb_of_hits));
+    for(size_t lane = 0; lane < S::width; lane++)
+      acc[k + lane] += accepted[lane];
+  }
+  return k;
+
+}
+#endif // __AVX2__ || __AVX512F__
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// one Metropolis sweep of all chains in lockstep, kappa and lambda hold one
+// value per chain. Adds the acceptance rate of every chain to acc
+inline void metropolis_update(ChainBundle& chains,
+                              std::vector<RandomStreams>& streams,
+                              const metropolis_kernel_t kernel,
+                              const std::vector<double>& kappa,
+                              const std::vector<double>& lambda,
+                              const double delta, const size_t nb_of_hits,
+                              std::vector<double>& acc){
+
+  const size_t K = chains.size();
+  const PhiField& phi = chains.geometry();
+  std::vector<uint32_t> k0(K), k1(K);
+  std::vector<uint64_t> step(K);
+  for(size_t k = 0; k < K; k++){
+    k0[k] = streams[k].key0();
+    k1[k] = streams[k].key1();
+    step[k] = streams[k].next_step();
+  }
+  std::vector<double> accepted(K, 0.);
+  profile().count(COUNTER_METROPOLIS_SWEEPS, K);
+  for(int parity=EVEN; parity<=ODD; parity++) {
+    const wall_clock::time_point parity_begin = wall_clock::now();
+    const size_t first = phi.begin(parity), last = phi.end(parity);
+    // the blocks of metropolis_sites, every chain sums its own changes
+    const size_t nb_blocks = (last - first + sums_block - 1)/sums_block;
+    std::vector<FieldSums> change(nb_blocks*K);
+    #pragma omp parallel
+    {
+      std::vector<double> rnd, thread_acc(K, 0.); // rnd sized by the kernel
+      #pragma omp for schedule(static)
+      for(size_t block = 0; block < nb_blocks; block++){
+        const size_t block_end = std::min(first + (block+1)*sums_block, last);
+        FieldSums* const block_change = change.data() + block*K;
+        for(size_t x = first + block*sums_block; x < block_end; x++){
+          size_t k = 0;
+          switch(kernel){
+#if defined(__AVX512F__)
+            case METROPOLIS_AVX512:
+              k = metropolis_site_lanes<simd_avx512>(chains, x, k0.data(),
+                                k1.data(), step.data(), kappa, lambda, delta,
+                                nb_of_hits, rnd, block_change,
+                                thread_acc.data());
+              break;
+#endif
+#if defined(__AVX2__)
+            case METROPOLIS_AVX2:
+              k = metropolis_site_lanes<simd_avx2>(chains, x, k0.data(),
+                                k1.data(), step.data(), kappa, lambda, delta,
+                                nb_of_hits, rnd, block_change,
+                                thread_acc.data());
+              break;
+#endif
+            default:
+              break;
+          }
+          // chains which do not fill a whole vector
+          for(; k < K; k++){
+            RandomStream random = streams[k].stream(step[k],
+                                                    phi.global_index(x));
+            thread_acc[k] += metropolis_site(phi, chains.view(k), x, random,
+                                             kappa[k], lambda[k], delta,
+                                             nb_of_hits, block_change[k]);
+          }
+        }
+      }
+      #pragma omp critical
+      for(size_t k = 0; k < K; k++)
+        accepted[k] += thread_acc[k];
+    }
+    for(size_t block = 0; block < nb_blocks; block++)
+      for(size_t k = 0; k < K; k++)
+        chains.add_to_sums(k, change[block*K + k]);
+    profile().add_time(parity == EVEN ? TIMER_METROPOLIS_EVEN :
+                       TIMER_METROPOLIS_ODD, wall_clock::now() - parity_begin);
+    chains.update(parity); // communicate boundaries
+  }
+  for(size_t k = 0; k < K; k++)
+    acc[k] += accepted[k]/(4*nb_of_hits);
+
+}
+
+} // end of namespace
+
+#endif // CHAIN_BUNDLE_H_
@@ -0,0 +1,387 @@
+#ifndef CHECKPOINT_WRITER_H_
+#define CHECKPOINT_WRITER_H_
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef PARALLEL
+#include <mpi.h>
+#endif
+
+#include "mdp.h"
+#include "fpc.h"
+#include "instrumentation.h"
+#include "phi_field.h"
+
+namespace cluster {
+
+// Checkpoints, written in the background. One file holds everything a
+// restart needs: the field in the order of the global site index, component
+// by component, so it does not depend on the number of processes, the state
+// of the random numbers, the iteration and the running sums of the field.
+// Everything is 8-byte aligned, so the field can be taken straight from the
+// mapped file:
+//
+//   char magic[8] = "PHI4CFG", uint32 version = 2, uint32 compression (0 none,
+//   1 fpc), int32 L[4], int64 iteration, uint64 bytes[4], double sums[6]
+//   (phi_0..3, phi^2, phi^4 over the lattice), uint32 random_bytes, uint32
+//   unused, char random_state[random_bytes], then the four components, raw
+//   doubles or compressed with FPC (fpc.h); every part padded to 8 bytes
+//
+// save() gathers the local sites of all processes on process 0 - the only
+// part the chain waits for - and hands the copy to a thread which compresses
+// it, writes filename.tmp and renames it to filename once it is complete, so
+// a crash never leaves a half written checkpoint behind. With keep > 0 only
+// the newest keep checkpoints every chain wrote in this run are kept, files of
+// earlier runs are never touched.
+class CheckpointWriter {
+
+public:
+  CheckpointWriter(const int L[4], const bool compress, const size_t keep) :
+                                  compress(compress), keep(keep), stop(false) {
+    for(size_t mu = 0; mu < 4; mu++)
+      this->L[mu] = L[mu];
+    V = size_t(L[0])*L[1]*L[2]*L[3];
+    if(mdp.me() == 0)
+      worker = std::thread(&CheckpointWriter::work, this);
+  };
+  ~CheckpointWriter() { finish(); };
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  // copies the field of iteration on all processes, the file is written
+  // later by process 0. Waits if the previous checkpoint is still queued
+  inline void save(const PhiField& phi, const int64_t iteration,
+                   const std::string& random_state,
+                   const std::string& filename) {
+
+    ScopedTimer timer(TIMER_CHECKPOINT);
+    Job job;
+    job.iteration = iteration;
+    job.random_state = random_state;
+    job.sums = phi.global_sums();
+    job.filename = filename;
+    if(mdp.me() == 0)
+      for(auto& c : job.comp)
+        c.resize(V);
+    gather(phi, job);
+    if(mdp.me() != 0)
+      return;
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]{ return jobs.empty(); });
+    jobs.push_back(std::move(job));
+    changed.notify_all();
+  };
+  // writes everything saved so far and stops the thread
+  inline void finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    if(worker.joinable())
+      worker.join();
+  };
+
+private:
+  struct Job {
+    int64_t iteration;
+    std::string random_state, filename;
+    FieldSums sums;
+    std::array<std::vector<double>, 4> comp;
+  };
+
+  // the local sites of every process into job.comp on process 0
+  inline void gather(const PhiField& phi, Job& job) const {
+    const size_t n = phi.local_volume();
+#ifndef PARALLEL
+    for(size_t c = 0; c < 4; c++)
+      for(size_t x = 0; x < n; x++)
+        job.comp[c][phi.global_index(x)] = phi[c][x];
+#else
+    const int nproc = mdp.nproc();
+    int local = n;
+    std::vector<int> count(nproc), displ(nproc, 0);
+    MPI_Gather(&local, 1, MPI_INT, count.data(), 1, MPI_INT, 0,
+               MPI_COMM_WORLD);
+    for(int p = 1; p < nproc; p++)
+      displ[p] = displ[p-1] + count[p-1];
+    std::vector<int> index(mdp.me() == 0 ? V : 0);
+    std::vector<double> values(mdp.me() == 0 ? V : 0), mine(n);
+    MPI_Gatherv(phi.global_indices(), local, MPI_INT, index.data(),
+                count.data(), displ.data(), MPI_INT, 0, MPI_COMM_WORLD);
+    for(size_t c = 0; c < 4; c++){
+      mine.assign(phi[c], phi[c] + n); // double, whatever the field stores
+      MPI_Gatherv(mine.data(), local, MPI_DOUBLE, values.data(), count.data(),
+                  displ.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+      for(size_t i = 0; i < values.size(); i++)
+        job.comp[c][index[i]] = values[i];
+    }
+#endif
+  };
+
+  inline void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+      changed.wait(lock, [this]{ return stop || !jobs.empty(); });
+      if(jobs.empty())
+        return; // stopped and drained
+      Job job = std::move(jobs.front());
+      jobs.pop_front();
+      changed.notify_all();
+      lock.unlock();
+      write(job);
+      lock.lock();
+    }
+  };
+  inline void write(const Job& job) {
+    ScopedTimer timer(TIMER_CHECKPOINT_WRITE);
+    // header, random state and the four components
+    std::vector<char> header(128, 0);
+    const uint32_t version = 2, compression = compress ? 1 : 0;
+    const uint32_t random_bytes = job.random_state.size();
+    const double sums[6] = {job.sums.phi[0], job.sums.phi[1], job.sums.phi[2],
+                            job.sums.phi[3], job.sums.phi2, job.sums.phi4};
+    memcpy(&header[0], "PHI4CFG", 8);
+    memcpy(&header[8], &version, 4);
+    memcpy(&header[12], &compression, 4);
+    for(size_t mu = 0; mu < 4; mu++)
+      memcpy(&header[16 + 4*mu], &L[mu], 4);
+    memcpy(&header[32], &job.iteration, 8);
+    memcpy(&header[72], sums, 48);
+    memcpy(&header[120], &random_bytes, 4);
+    header.insert(header.end(), job.random_state.begin(),
+                  job.random_state.end());
+    header.resize(padded(header.size()), 0);
+    std::array<std::vector<char>, 4> data;
+    for(size_t c = 0; c < 4; c++){
+      if(compress){
+        FPC::compress(job.comp[c].data(), V, data[c]);
+        const uint64_t bytes = data[c].size();
+        memcpy(&header[40 + 8*c], &bytes, 8);
+        data[c].resize(padded(data[c].size()), 0);
+      }
+      else{
+        const uint64_t bytes = 8*V;
+        memcpy(&header[40 + 8*c], &bytes, 8);
+      }
+    }
+
+    const std::string tmp = job.filename + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    bool ok = (f != NULL) &&
+              fwrite(header.data(), 1, header.size(), f) == header.size();
+    for(size_t c = 0; c < 4 && ok; c++)
+      ok = compress ?
+           fwrite(data[c].data(), 1, data[c].size(), f) == data[c].size() :
+           fwrite(job.comp[c].data(), sizeof(double), V, f) == V;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if(f != NULL)
+      ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), job.filename.c_str()) != 0){
+      printf("Could not write checkpoint %s\n", job.filename.c_str());
+      remove(tmp.c_str());
+      return;
+    }
+    size_t bytes = header.size();
+    for(size_t c = 0; c < 4; c++)
+      bytes += compress ? data[c].size() : 8*V;
+    profile().count(COUNTER_BYTES_WRITTEN, bytes);
+    // retention, per chain: the name up to ".conf" is the same
+    if(keep > 0){
+      auto& chain = written[job.filename.substr(0,
+                                                job.filename.rfind(".conf"))];
+      chain.push_back(job.filename);
+      if(chain.size() > keep){
+        remove(chain.front().c_str());
+        chain.pop_front();
+      }
+    }
+  };
+
+  static inline size_t padded(const size_t bytes) { return (bytes + 7)/8*8; };
+
+  int L[4];
+  size_t V;
+  const bool compress;
+  const size_t keep;
+  std::map<std::string, std::deque<std::string> > written;
+  bool stop;
+  std::deque<Job> jobs;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread worker;
+
+}; // end of class definition
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// true if filename starts like a file written by CheckpointWriter
+inline bool is_checkpoint(const std::string& filename){
+
+  char magic[8];
+  FILE* f = fopen(filename.c_str(), "rb");
+  if(f == NULL)
+    return false;
+  const bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, "PHI4CFG", 8) == 0;
+  fclose(f);
+  return ok;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// reads a checkpoint written by CheckpointWriter: the field goes from the
+// mapped file into the local sites of phi, the halo and the mdp field, the
+// running sums are set to the stored ones. Returns false if filename is not
+// such a file, e.g. one written with mdp_field::save, or after a message if
+// it is cut off or corrupt. Files of version 1 hold only the field, the sums
+// are recomputed and random_state stays empty
+inline bool read_checkpoint(const std::string& filename, PhiField& phi,
+                            const int L[4], int64_t& iteration,
+                            std::string& random_state){
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if(fd < 0)
+    return false;
+  if(fstat(fd, &st) != 0 || st.st_size < 72){
+    close(fd);
+    return false;
+  }
+  const size_t size = st.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return false;
+  const char* const file = static_cast<const char*>(map);
+  if(memcmp(file, "PHI4CFG", 8) != 0){
+    munmap(map, size);
+    return false;
+  }
+  uint32_t version, compression;
+  int32_t file_L[4];
+  uint64_t bytes[4];
+  memcpy(&version, file + 8, 4);
+  memcpy(&compression, file + 12, 4);
+  memcpy(file_L, file + 16, 16);
+  memcpy(&iteration, file + 32, 8);
+  memcpy(bytes, file + 40, 32);
+  if(file_L[0] != L[0] || file_L[1] != L[1] || file_L[2] != L[2] ||
+     file_L[3] != L[3]){
+    std::cerr << filename << " has a different lattice!" << endl;
+    exit(1);
+  }
+  size_t pos = 72;
+  double sums[6];
+  uint32_t random_bytes = 0;
+  if(version >= 2){
+    if(size < 128){
+      std::cerr << filename << " is cut off!" << endl;
+      munmap(map, size);
+      return false;
+    }
+    memcpy(sums, file + 72, 48);
+    memcpy(&random_bytes, file + 120, 4);
+    pos = (128 + size_t(random_bytes) + 7)/8*8;
+  }
+  // the random state and the four components have to fit into the file,
+  // an uncompressed component holds one double per site
+  const size_t V = size_t(L[0])*L[1]*L[2]*L[3];
+  size_t end = pos;
+  bool fits = true;
+  for(size_t c = 0; c < 4; c++){
+    if(compression != 1 && bytes[c] != V*sizeof(double)){
+      std::cerr << filename << " is corrupt!" << endl;
+      munmap(map, size);
+      return false;
+    }
+    fits = fits && end <= size && bytes[c] <= size - end;
+    if(fits)
+      end += (version >= 2) ? (bytes[c] + 7)/8*8 : bytes[c];
+  }
+  if(!fits || end > size){
+    std::cerr << filename << " is cut off!" << endl;
+    munmap(map, size);
+    return false;
+  }
+  random_state.clear();
+  if(version >= 2)
+    random_state.assign(file + 128, random_bytes);
+  // every process takes its sites, an uncompressed field is read in place
+  std::vector<double> values(compression == 1 ? V : 0);
+  for(size_t c = 0; c < 4; c++){
+    const double* field = reinterpret_cast<const double*>(file + pos);
+    if(compression == 1){
+      if(FPC::decompress(file + pos, bytes[c], values.data(), V) == NULL){
+        std::cerr << filename << " is corrupt!" << endl;
+        munmap(map, size);
+        return false;
+      }
+      field = values.data();
+    }
+    for(size_t x = 0; x < phi.local_volume(); x++)
+      phi[c][x] = field[phi.global_index(x)];
+    pos += (version >= 2) ? (bytes[c] + 7)/8*8 : bytes[c];
+  }
+  munmap(map, size);
+  phi.update(EVEN);
+  phi.update(ODD);
+  phi.store();
+  if(version >= 2){
+    FieldSums global;
+    global.phi = {{sums[0], sums[1], sums[2], sums[3]}};
+    global.phi2 = sums[4];
+    global.phi4 = sums[5];
+    phi.restore_sums(global);
+  }
+  else
+    phi.resum();
+  return true;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the state of the mdp_random_generator of the mdp backend, which it only
+// writes to and reads from a file, as a string for the checkpoint
+inline std::string random_state(mdp_random_generator& random,
+                                const std::string& tmp){
+
+  random.write_state(tmp);
+  std::ifstream f(tmp, std::ios::binary);
+  const std::string state((std::istreambuf_iterator<char>(f)),
+                          std::istreambuf_iterator<char>());
+  remove(tmp.c_str());
+  return state;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline void set_random_state(mdp_random_generator& random,
+                             const std::string& state, const std::string& tmp){
+
+  {
+    std::ofstream f(tmp, std::ios::binary);
+    f << state;
+  }
+  random.read_state(tmp);
+  remove(tmp.c_str());
+
+}
+
+} // end of namespace
+
+#endif // CHECKPOINT_WRITER_H_
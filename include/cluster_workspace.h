@@ -0,0 +1,59 @@
+#ifndef CLUSTER_WORKSPACE_H_
+#define CLUSTER_WORKSPACE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace cluster {
+
+// Everything cluster_update needs besides the field, allocated once and reused
+// for every call.
+//
+// A site is marked by writing the current epoch, so starting a new update is
+// an increment instead of clearing a lattice-sized array; only when the epoch
+// counter wraps around the marks are reset. The member list is filled in the
+// order in which sites join the cluster, which makes it the breadth-first
+// frontier queue at the same time: everything behind the read position still
+// has to be grown from. The flip then runs over the members only.
+class ClusterWorkspace {
+
+public:
+  ClusterWorkspace(const size_t nvol) : mark(nvol, 0), epoch(0),
+                                        member(nvol), size(0), head(0) {};
+
+  // forget the previous update
+  inline void start() {
+    if(++epoch == 0){
+      std::fill(mark.begin(), mark.end(), 0);
+      epoch = 1;
+    }
+    size = head = 0;
+  };
+
+  inline bool visited(const size_t x) const { return mark[x] == epoch; };
+  // x joins the cluster and the frontier
+  inline void visit(const size_t x) {
+    mark[x] = epoch;
+    member[size++] = x;
+  };
+
+  // frontier queue
+  inline bool frontier_empty() const { return head == size; };
+  inline size_t pop_frontier() { return member[head++]; };
+
+  // all sites visited since start(), in joining order
+  inline size_t members() const { return size; };
+  inline size_t operator[](const size_t i) const { return member[i]; };
+
+private:
+  std::vector<uint32_t> mark;
+  uint32_t epoch;
+  std::vector<size_t> member;
+  size_t size, head;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // CLUSTER_WORKSPACE_H_
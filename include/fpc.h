@@ -0,0 +1,114 @@
+#ifndef FPC_H_
+#define FPC_H_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace cluster {
+
+// Lossless compression of doubles after FPC (Burtscher and Ratanaworabhan,
+// IEEE Trans. Comput. 58, 2009). Every value is predicted by a finite context
+// model (fcm) and a differential one (dfcm) from the values before it; the
+// better prediction is XORed with the value and only the bytes below the
+// leading zero bytes of the residual are stored. A 4-bit code per value, two
+// of them packed into one byte in front of the residuals of the pair, holds
+// the predictor and the number of leading zero bytes (0..8, without 4).
+//
+// The field of a thermalised configuration is noisy, so this mostly saves the
+// sign and exponent bytes; the gain is modest but costs no precision.
+class FPC {
+
+public:
+  FPC() : fcm(size), dfcm(size), fcm_hash(0), dfcm_hash(0), last(0) {};
+
+  // appends the compressed values to out
+  static inline void compress(const double* values, const size_t n,
+                              std::vector<char>& out) {
+    FPC fpc;
+    out.reserve(out.size() + 9*n/8 + 1);
+    for(size_t i = 0; i < n; i += 2){
+      const size_t code_pos = out.size();
+      out.push_back(0);
+      uint8_t codes = 0;
+      for(size_t j = i; j < i + 2 && j < n; j++){
+        uint64_t bits;
+        memcpy(&bits, values + j, sizeof(bits));
+        const uint64_t r_fcm = bits ^ fpc.fcm[fpc.fcm_hash];
+        const uint64_t r_dfcm = bits ^ (fpc.dfcm[fpc.dfcm_hash] + fpc.last);
+        const bool use_dfcm = r_dfcm < r_fcm;
+        const uint64_t residual = use_dfcm ? r_dfcm : r_fcm;
+        size_t zeros = leading_zero_bytes(residual);
+        if(zeros == 4)
+          zeros = 3; // 4 has no code, store one more byte
+        codes |= (uint8_t(use_dfcm) << 3 | code_of(zeros)) << 4*(j - i);
+        for(size_t b = 8 - zeros; b-- > 0; )
+          out.push_back(char(residual >> 8*b));
+        fpc.learn(bits);
+      }
+      out[code_pos] = char(codes);
+    }
+  };
+  // reads n values from the bytes at in, returns the position behind them
+  // or NULL if they would need more than bytes, i.e. the data is cut off or
+  // corrupt
+  static inline const char* decompress(const char* in, const size_t bytes,
+                                       double* values, const size_t n) {
+    const char* const end = in + bytes;
+    FPC fpc;
+    for(size_t i = 0; i < n; i += 2){
+      if(in == end)
+        return NULL;
+      const uint8_t codes = uint8_t(*in++);
+      for(size_t j = i; j < i + 2 && j < n; j++){
+        const uint8_t code = codes >> 4*(j - i) & 15;
+        const size_t zeros = zeros_of(code & 7);
+        if(size_t(end - in) < 8 - zeros)
+          return NULL;
+        uint64_t residual = 0;
+        for(size_t b = 0; b < 8 - zeros; b++)
+          residual = residual << 8 | uint8_t(*in++);
+        const uint64_t prediction = (code & 8) ?
+                          fpc.dfcm[fpc.dfcm_hash] + fpc.last :
+                          fpc.fcm[fpc.fcm_hash];
+        const uint64_t bits = residual ^ prediction;
+        memcpy(values + j, &bits, sizeof(bits));
+        fpc.learn(bits);
+      }
+    }
+    return in;
+  };
+
+private:
+  static const size_t size = size_t(1) << 16; // entries of the hash tables
+
+  inline void learn(const uint64_t bits) {
+    fcm[fcm_hash] = bits;
+    fcm_hash = ((fcm_hash << 6) ^ (bits >> 48)) & (size - 1);
+    dfcm[dfcm_hash] = bits - last;
+    dfcm_hash = ((dfcm_hash << 2) ^ ((bits - last) >> 40)) & (size - 1);
+    last = bits;
+  };
+  static inline size_t leading_zero_bytes(const uint64_t r) {
+    size_t zeros = 0;
+    while(zeros < 8 && (r >> (56 - 8*zeros)) == 0)
+      zeros++;
+    return zeros;
+  };
+  // 0..3 and 5..8 leading zero bytes in 3 bits
+  static inline uint8_t code_of(const size_t zeros) {
+    return zeros < 4 ? zeros : zeros - 1;
+  };
+  static inline size_t zeros_of(const uint8_t code) {
+    return code < 4 ? code : code + 1;
+  };
+
+  std::vector<uint64_t> fcm, dfcm;
+  size_t fcm_hash, dfcm_hash;
+  uint64_t last;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // FPC_H_
@@ -0,0 +1,447 @@
+#ifndef HMC_H_
+#define HMC_H_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fftw3.h>
+
+#include "mdp.h"
+#include "instrumentation.h"
+#include "metropolis_simd.h"
+#include "phi_field.h"
+#include "propagator_fft.h"
+#include "random_streams.h"
+
+namespace cluster {
+
+// Hybrid Monte Carlo on the structure-of-arrays field with the action of
+// metropolis_update,
+//
+//   S = sum_x [ -2 kappa sum_mu phi_x.phi_{x+mu} + phi_x^2 + lambda (phi_x^2-1)^2 ]
+//
+// One trajectory draws Gaussian momenta pi, integrates the equations of
+// motion of H = pi M^-1 pi/2 + S over the trajectory length with a reversible
+// integrator and accepts the end point with min(1, exp(-dH)). All sites move
+// at once, which reaches the modes of non-zero momentum that local updates
+// and the embedded clusters move slowly.
+//
+// The integrator is leapfrog or the second order minimum norm integrator of
+// Omelyan, Mryglod and Folk (Comput. Phys. Commun. 151, 2003), which needs
+// two forces per step but has a much smaller error. The force kernel runs in
+// the SIMD lanes of metropolis_kernel, one site per lane.
+//
+// Without Fourier acceleration M = 1. With a mass m^2 > 0 the momenta have
+// the mass matrix M(p) = (p^2 + m^2)/(16 + m^2) in momentum space, p^2 the
+// lattice momentum. The free action has the curvature 2 kappa (p^2 +
+// (1 - 8 kappa)/kappa), so for m^2 near the effective mass all modes move at
+// about the same speed instead of the slow low momenta. M^-1 pi and the
+// momenta are computed with r2c/c2r FFTs of the four components, planned
+// with the wisdom of PropagatorFFT; Fourier acceleration needs a single
+// process.
+//
+// Every process draws the momenta of its sites from the site streams and the
+// accept step from the global stream of the trajectory, so the chain does not
+// depend on the number of threads or processes. With -DFLOAT_FIELD the field
+// is rounded to single precision after every drift, which breaks the
+// reversibility at the level of that rounding.
+
+typedef enum hmc_integrator_t {
+  HMC_LEAPFROG=0,
+  HMC_OMELYAN
+} hmc_integrator_t;
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// -dS/dphi at the local site x into force[c][x]
+inline void force_site(const PhiField& phi, const size_t x,
+                       const double kappa, const double lambda,
+                       const std::array<double*, 4>& force){
+
+  const PhiField::site_t p = phi.site(x);
+  const double phiSqr = p[0]*p[0] + p[1]*p[1] + p[2]*p[2] + p[3]*p[3];
+  const double potential = 2. + 4.*lambda*(phiSqr - 1.);
+  for(size_t comp = 0; comp < 4; comp++){
+    const real_t* const phi_comp = phi[comp];
+    double neighbourSum = 0.;
+    for(size_t dir = 0; dir < 4; dir++)
+      neighbourSum += phi_comp[phi.neighbour(dir, x)] +
+                      phi_comp[phi.neighbour(dir+4, x)];
+    force[comp][x] = 2.*kappa*neighbourSum - potential*p[comp];
+  }
+
+}
+#if defined(__AVX2__) || defined(__AVX512F__)
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// force_site on the sites [x, x+width)
+template<class S>
+inline void force_chunk(const PhiField& phi, const size_t x,
+                        const double kappa, const double lambda,
+                        const std::array<double*, 4>& force){
+
+  typedef typename S::vec vec;
+  const vec vkappa = S::set1(2.*kappa), vlambda = S::set1(4.*lambda);
+  const vec one = S::set1(1.), two = S::set1(2.);
+  vec p[4], phiSqr = S::set1(0.);
+  for(size_t comp = 0; comp < 4; comp++){
+    p[comp] = S::load(phi[comp] + x);
+    phiSqr = S::add(phiSqr, S::mul(p[comp], p[comp]));
+  }
+  const vec potential = S::add(two, S::mul(vlambda, S::sub(phiSqr, one)));
+  for(size_t comp = 0; comp < 4; comp++){
+    const real_t* const phi_comp = phi[comp];
+    vec neighbourSum = S::set1(0.);
+    for(size_t dir = 0; dir < 4; dir++)
+      neighbourSum = S::add(neighbourSum,
+                            S::add(S::gather(phi_comp, phi.neighbours(dir) + x),
+                                   S::gather(phi_comp,
+                                             phi.neighbours(dir+4) + x)));
+    S::store(force[comp] + x, S::sub(S::mul(vkappa, neighbourSum),
+                                     S::mul(potential, p[comp])));
+  }
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+template<class S>
+inline void force_simd(const PhiField& phi, const double kappa,
+                       const double lambda,
+                       const std::array<double*, 4>& force){
+
+  const size_t nvol = phi.local_volume();
+  const size_t nb_blocks = (nvol + sums_block - 1)/sums_block;
+  #pragma omp parallel for schedule(static)
+  for(size_t block = 0; block < nb_blocks; block++){
+    const size_t block_end = std::min((block+1)*sums_block, nvol);
+    size_t x = block*sums_block;
+    for(; x + S::width <= block_end; x += S::width)
+      force_chunk<S>(phi, x, kappa, lambda, force);
+    for(; x < block_end; x++)
+      force_site(phi, x, kappa, lambda, force);
+  }
+
+}
+#endif // __AVX2__ || __AVX512F__
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the force on all local sites, with the kernel of metropolis_kernel
+inline void hmc_force(const PhiField& phi, const metropolis_kernel_t kernel,
+                      const double kappa, const double lambda,
+                      const std::array<double*, 4>& force){
+
+  ScopedTimer timer(TIMER_HMC_FORCE);
+  switch(kernel){
+#if defined(__AVX512F__)
+    case METROPOLIS_AVX512:
+      force_simd<simd_avx512>(phi, kappa, lambda, force);
+      return;
+#endif
+#if defined(__AVX2__)
+    case METROPOLIS_AVX2:
+      force_simd<simd_avx2>(phi, kappa, lambda, force);
+      return;
+#endif
+    default:
+      #pragma omp parallel for schedule(static)
+      for(size_t x = 0; x < phi.local_volume(); x++)
+        force_site(phi, x, kappa, lambda, force);
+  }
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the action of the local sites, summed block by block so it does not depend
+// on the number of threads
+inline double hmc_action(const PhiField& phi, const double kappa,
+                         const double lambda){
+
+  const size_t nvol = phi.local_volume();
+  const size_t nb_blocks = (nvol + sums_block - 1)/sums_block;
+  std::vector<double> partial(nb_blocks, 0.);
+  #pragma omp parallel for schedule(static)
+  for(size_t block = 0; block < nb_blocks; block++){
+    const size_t block_end = std::min((block+1)*sums_block, nvol);
+    double s = 0.;
+    for(size_t x = block*sums_block; x < block_end; x++){
+      const PhiField::site_t p = phi.site(x);
+      const double phiSqr = p[0]*p[0] + p[1]*p[1] + p[2]*p[2] + p[3]*p[3];
+      double hopping = 0.;
+      for(size_t comp = 0; comp < 4; comp++){
+        const real_t* const phi_comp = phi[comp];
+        double up = 0.; // each link once
+        for(size_t dir = 4; dir < 8; dir++)
+          up += phi_comp[phi.neighbour(dir, x)];
+        hopping += p[comp]*up;
+      }
+      s += -2.*kappa*hopping + phiSqr + lambda*(phiSqr - 1.)*(phiSqr - 1.);
+    }
+    partial[block] = s;
+  }
+  double action = 0.;
+  for(const auto& s : partial)
+    action += s;
+  return action;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+class HybridMonteCarlo {
+
+public:
+  HybridMonteCarlo(const int L[4], const PhiField& phi,
+                   const std::string& outpath,
+                   const metropolis_kernel_t kernel,
+                   const hmc_integrator_t integrator, const int nb_steps,
+                   const double length, const double fourier_mass) :
+                 kernel(kernel), integrator(integrator), nb_steps(nb_steps),
+                 epsilon(length/nb_steps), fourier(fourier_mass > 0.),
+                 nvol(phi.local_volume()) {
+
+    for(size_t c = 0; c < 4; c++){
+      momentum[c].resize(nvol);
+      force[c].resize(nvol);
+      velocity[c].resize(nvol);
+      saved[c].resize(phi.nvol());
+    }
+    if(fourier)
+      plan_fourier(L, phi, outpath, fourier_mass);
+  };
+  ~HybridMonteCarlo() {
+    if(!fourier)
+      return;
+    fftw_destroy_plan(forward);
+    fftw_destroy_plan(backward);
+    fftw_free(input);
+    fftw_free(output);
+  };
+  HybridMonteCarlo(const HybridMonteCarlo&) = delete;
+  HybridMonteCarlo& operator=(const HybridMonteCarlo&) = delete;
+
+  // one trajectory, returns whether it was accepted. Called by all processes
+  inline bool trajectory(PhiField& phi, RandomStreams& streams,
+                         const double kappa, const double lambda) {
+
+    ScopedTimer timer(TIMER_HMC);
+    const uint64_t step = streams.next_step();
+    profile().count(COUNTER_HMC_TRAJECTORIES);
+    // the start, to go back to if the trajectory is rejected
+    for(size_t c = 0; c < 4; c++)
+      std::copy(phi[c], phi[c] + saved[c].size(), saved[c].begin());
+    const FieldSums saved_sums = phi.local_sums();
+
+    double H[2] = {draw_momenta(phi, streams, step) +
+                   hmc_action(phi, kappa, lambda), 0.};
+    hmc_force(phi, kernel, kappa, lambda, pointers(force));
+    for(int i = 0; i < nb_steps; i++)
+      if(integrator == HMC_LEAPFROG){
+        kick(.5*epsilon);
+        drift(phi, epsilon);
+        hmc_force(phi, kernel, kappa, lambda, pointers(force));
+        kick(.5*epsilon);
+      }
+      else{
+        kick(xi*epsilon);
+        drift(phi, .5*epsilon);
+        hmc_force(phi, kernel, kappa, lambda, pointers(force));
+        kick((1. - 2.*xi)*epsilon);
+        drift(phi, .5*epsilon);
+        hmc_force(phi, kernel, kappa, lambda, pointers(force));
+        kick(xi*epsilon);
+      }
+    H[1] = kinetic_energy() + hmc_action(phi, kappa, lambda);
+    mdp.add(H, 2);
+
+    // the same decision on every process
+    const double dH = H[1] - H[0];
+    RandomStream random = streams.global_stream(step);
+    const bool accepted = (dH <= 0. || random.plain() < exp(-dH));
+    if(accepted){
+      phi.resum();
+      profile().count(COUNTER_HMC_ACCEPTED);
+    }
+    else{ // the halo is restored as well
+      for(size_t c = 0; c < 4; c++)
+        std::copy(saved[c].begin(), saved[c].end(), phi[c]);
+      phi.set_local_sums(saved_sums);
+    }
+    nb_trajectories++;
+    nb_accepted += accepted;
+    sum_dH += dH;
+    sum_exp_dH += exp(-dH);
+    return accepted;
+
+  };
+
+  // acceptance statistics of all trajectories so far. <exp(-dH)> is 1 up to
+  // the statistical error if the integrator is reversible and area preserving
+  inline double acceptance() const {
+    return nb_trajectories > 0 ? double(nb_accepted)/nb_trajectories : 0.;
+  };
+  inline std::string summary() const {
+    std::ostringstream s;
+    s << "\thmc: " << nb_trajectories << " trajectories, acceptance "
+      << acceptance() << ", <dH> = "
+      << (nb_trajectories > 0 ? sum_dH/nb_trajectories : 0.)
+      << ", <exp(-dH)> = "
+      << (nb_trajectories > 0 ? sum_exp_dH/nb_trajectories : 0.);
+    return s.str();
+  };
+
+private:
+  typedef std::array<std::vector<double>, 4> field_t;
+
+  static inline std::array<double*, 4> pointers(field_t& f) {
+    return {{f[0].data(), f[1].data(), f[2].data(), f[3].data()}};
+  };
+
+  // pi += epsilon force
+  inline void kick(const double epsilon) {
+    for(size_t c = 0; c < 4; c++){
+      double* const p = momentum[c].data();
+      const double* const f = force[c].data();
+      #pragma omp parallel for simd schedule(static)
+      for(size_t x = 0; x < nvol; x++)
+        p[x] += epsilon*f[x];
+    }
+  };
+  // phi += epsilon M^-1 pi, then the halo
+  inline void drift(PhiField& phi, const double epsilon) {
+    const field_t& v = fourier ? mass_inverse_times(momentum) : momentum;
+    for(size_t c = 0; c < 4; c++){
+      real_t* const q = phi[c];
+      const double* const p = v[c].data();
+      #pragma omp parallel for simd schedule(static)
+      for(size_t x = 0; x < nvol; x++)
+        q[x] = real_t(q[x] + epsilon*p[x]);
+    }
+    phi.update(EVEN);
+    phi.update(ODD);
+  };
+  // the local part of pi M^-1 pi/2
+  inline double kinetic_energy() {
+    const field_t& v = fourier ? mass_inverse_times(momentum) : momentum;
+    double K = 0.;
+    for(size_t c = 0; c < 4; c++)
+      for(size_t x = 0; x < nvol; x++)
+        K += momentum[c][x]*v[c][x];
+    return .5*K;
+  };
+  // Gaussian momenta with covariance M from the site streams, returns the
+  // local part of their kinetic energy
+  inline double draw_momenta(const PhiField& phi, const RandomStreams& streams,
+                             const uint64_t step) {
+    field_t& eta = fourier ? velocity : momentum;
+    #pragma omp parallel for schedule(static)
+    for(size_t x = 0; x < nvol; x++){
+      RandomStream random = streams.stream(step, phi.global_index(x));
+      for(size_t c = 0; c < 4; c += 2){ // Box-Muller, two at once
+        const double radius = sqrt(-2.*log(1. - random.plain()));
+        const double angle = 2.*M_PI*random.plain();
+        eta[c][x] = radius*cos(angle);
+        eta[c+1][x] = radius*sin(angle);
+      }
+    }
+    double K = 0.;
+    for(size_t c = 0; c < 4; c++)
+      for(size_t x = 0; x < nvol; x++)
+        K += eta[c][x]*eta[c][x];
+    if(fourier) // pi = M^1/2 eta, so pi M^-1 pi = eta eta
+      fourier_filter(eta, sqrt_mass, momentum);
+    return .5*K;
+  };
+
+  // FFTs of the four components, interleaved in the order of the global
+  // sites, and the mass matrix in momentum space
+  inline void plan_fourier(const int L[4], const PhiField& phi,
+                           const std::string& outpath, const double mass) {
+    const size_t V = size_t(L[0])*L[1]*L[2]*L[3];
+    const size_t half = V/L[3]*(L[3]/2+1);
+    const std::string wisdom_file = fftw_wisdom_file(L, outpath);
+    fftw_import_wisdom_from_filename(wisdom_file.c_str());
+    int n[4], onembed[4];
+    for(size_t j = 0; j < 4; j++)
+      n[j] = onembed[j] = L[j];
+    onembed[3] = L[3]/2+1;
+    input = fftw_alloc_real(4*V);
+    output = fftw_alloc_complex(4*half);
+    forward = fftw_plan_many_dft_r2c(4, n, 4, input, n, 4, 1, output, onembed,
+                                     4, 1, FFTW_MEASURE);
+    backward = fftw_plan_many_dft_c2r(4, n, 4, output, onembed, 4, 1, input, n,
+                                      4, 1, FFTW_MEASURE);
+    export_fftw_wisdom(wisdom_file);
+    // M(p) with the 1/V of the unnormalised transforms
+    inverse_mass.resize(half);
+    sqrt_mass.resize(half);
+    size_t k = 0;
+    for(int n0 = 0; n0 < L[0]; n0++)
+      for(int n1 = 0; n1 < L[1]; n1++)
+        for(int n2 = 0; n2 < L[2]; n2++)
+          for(int n3 = 0; n3 <= L[3]/2; n3++, k++){
+            const int m[4] = {n0, n1, n2, n3};
+            double p2 = 0.;
+            for(size_t mu = 0; mu < 4; mu++){
+              const double s = sin(M_PI*m[mu]/L[mu]);
+              p2 += 4.*s*s;
+            }
+            const double M = (p2 + mass)/(16. + mass);
+            inverse_mass[k] = 1./(M*V);
+            sqrt_mass[k] = sqrt(M)/V;
+          }
+    slots.resize(nvol);
+    for(size_t x = 0; x < nvol; x++)
+      slots[x] = phi.global_index(x);
+  };
+  // out = the convolution of in with factor, which is given in momentum space
+  inline void fourier_filter(const field_t& in, const std::vector<double>& factor,
+                             field_t& out) {
+    const wall_clock::time_point begin = wall_clock::now();
+    for(size_t x = 0; x < nvol; x++)
+      for(size_t c = 0; c < 4; c++)
+        input[4*size_t(slots[x]) + c] = in[c][x];
+    fftw_execute(forward);
+    for(size_t k = 0; k < factor.size(); k++)
+      for(size_t c = 0; c < 4; c++){
+        output[4*k + c][0] *= factor[k];
+        output[4*k + c][1] *= factor[k];
+      }
+    fftw_execute(backward);
+    for(size_t x = 0; x < nvol; x++)
+      for(size_t c = 0; c < 4; c++)
+        out[c][x] = input[4*size_t(slots[x]) + c];
+    profile().add_time(TIMER_FFT, wall_clock::now() - begin);
+  };
+  // M^-1 pi in velocity
+  inline const field_t& mass_inverse_times(const field_t& pi) {
+    fourier_filter(pi, inverse_mass, velocity);
+    return velocity;
+  };
+
+  const metropolis_kernel_t kernel;
+  const hmc_integrator_t integrator;
+  const int nb_steps;
+  const double epsilon;
+  const double xi = 0.1931833275037836; // of the Omelyan integrator
+  const bool fourier;
+  const size_t nvol;
+  field_t momentum, force, velocity;
+  std::array<std::vector<real_t>, 4> saved;
+  // Fourier acceleration
+  double* input = NULL;
+  fftw_complex* output = NULL;
+  fftw_plan forward, backward;
+  std::vector<double> inverse_mass, sqrt_mass;
+  std::vector<int> slots;
+  // statistics
+  size_t nb_trajectories = 0, nb_accepted = 0;
+  double sum_dH = 0., sum_exp_dH = 0.;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // HMC_H_
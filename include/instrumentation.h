@@ -0,0 +1,192 @@
+#ifndef INSTRUMENTATION_H_
+#define INSTRUMENTATION_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "mdp.h"
+
+namespace cluster {
+
+// Wall clock timers and event counters of the hot paths. A kernel opens a
+// ScopedTimer for its phase and counts events with profile().count(); both
+// add to atomics, so the measurement and checkpoint threads use them as
+// well. A timer costs two reads of the steady clock, there are a few per
+// sweep. Timers nest where the phases do: the halo exchange is timed inside
+// the updates that trigger it, the FFT inside the measurement.
+//
+// write_json() collects the totals of every process and writes them, one
+// value per process, as a JSON file.
+
+typedef std::chrono::steady_clock wall_clock;
+
+// seconds of a wall clock interval
+inline double elapsed_seconds(const wall_clock::duration& interval){
+  return std::chrono::duration<double>(interval).count();
+}
+
+typedef enum timer_id_t {
+  TIMER_METROPOLIS_EVEN=0,
+  TIMER_METROPOLIS_ODD,
+  TIMER_OVERRELAXATION,
+  TIMER_HEATBATH,
+  TIMER_HMC,              // whole trajectories
+  TIMER_HMC_FORCE,
+  TIMER_HALO_EXCHANGE,
+  TIMER_CLUSTER_GROWTH,
+  TIMER_CLUSTER_FLIP,
+  TIMER_MEASUREMENT,
+  TIMER_FFT,
+  TIMER_CHECKPOINT,       // copying the field, on the update thread
+  TIMER_CHECKPOINT_WRITE, // writing it, in the background
+  TIMER_OBSERVABLES,      // writing the observable files
+  NB_TIMERS
+} timer_id_t;
+
+typedef enum counter_id_t {
+  COUNTER_METROPOLIS_SWEEPS=0,
+  COUNTER_OVERRELAXATION_SWEEPS,
+  COUNTER_OVERRELAXATION_REJECTIONS,
+  COUNTER_HEATBATH_SWEEPS,
+  COUNTER_HEATBATH_REJECTIONS, // Gaussian proposals drawn again
+  COUNTER_HMC_TRAJECTORIES,
+  COUNTER_HMC_ACCEPTED,
+  COUNTER_CLUSTER_UPDATES,
+  COUNTER_CLUSTERS,
+  COUNTER_SEED_RETRIES,   // start points of min_size clusters already taken
+  COUNTER_FLIPPED_SITES,
+  COUNTER_HALO_EXCHANGES,
+  COUNTER_MEASUREMENTS,
+  COUNTER_BYTES_WRITTEN,
+  NB_COUNTERS
+} counter_id_t;
+
+class Profile {
+
+public:
+  Profile() { reset(); };
+  Profile(const Profile&) = delete;
+  Profile& operator=(const Profile&) = delete;
+
+  inline void add_time(const timer_id_t id, const wall_clock::duration& time) {
+    nanoseconds[id].fetch_add(
+       std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+       std::memory_order_relaxed);
+    calls[id].fetch_add(1, std::memory_order_relaxed);
+  };
+  inline void count(const counter_id_t id, const uint64_t n = 1) {
+    counters[id].fetch_add(n, std::memory_order_relaxed);
+  };
+  // everything back to zero, the wall clock starts again
+  inline void reset() {
+    for(size_t i = 0; i < NB_TIMERS; i++){
+      nanoseconds[i].store(0);
+      calls[i].store(0);
+    }
+    for(auto& c : counters)
+      c.store(0);
+    start = wall_clock::now();
+  };
+
+  // the totals of all processes, written by process 0 to a temporary file
+  // which is renamed, so a reader never sees half of it. Called by all
+  // processes
+  inline void write_json(const std::string& filename,
+                         const int64_t iteration) const {
+    const size_t n = 2*NB_TIMERS + NB_COUNTERS;
+    const int nproc = mdp.nproc();
+    std::vector<double> all(n*nproc, 0.);
+    double* const mine = all.data() + n*mdp.me();
+    for(size_t i = 0; i < NB_TIMERS; i++){
+      mine[i] = 1e-9*nanoseconds[i].load();
+      mine[NB_TIMERS + i] = calls[i].load();
+    }
+    for(size_t i = 0; i < NB_COUNTERS; i++)
+      mine[2*NB_TIMERS + i] = counters[i].load();
+    mdp.add(all.data(), all.size());
+    if(mdp.me() != 0)
+      return;
+
+    // one value per process
+    auto list = [&](FILE* f, const size_t i, const char* format){
+      fprintf(f, "[");
+      for(int p = 0; p < nproc; p++){
+        fprintf(f, format, all[n*p + i]);
+        fprintf(f, p + 1 < nproc ? ", " : "]");
+      }
+    };
+    const std::string tmp = filename + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmp.c_str(), "w");
+    if(f == NULL){
+      std::cerr << "Could not write " << tmp << endl;
+      return;
+    }
+    fprintf(f, "{\n  \"iteration\": %lld,\n  \"wall_seconds\": %.6f,\n"
+               "  \"processes\": %d,\n  \"timers\": {\n",
+            (long long) iteration, elapsed_seconds(wall_clock::now() - start),
+            nproc);
+    for(size_t i = 0; i < NB_TIMERS; i++){
+      fprintf(f, "    \"%s\": {\"seconds\": ", timer_names[i]);
+      list(f, i, "%.6f");
+      fprintf(f, ", \"calls\": ");
+      list(f, NB_TIMERS + i, "%.0f");
+      fprintf(f, i + 1 < NB_TIMERS ? "},\n" : "}\n");
+    }
+    fprintf(f, "  },\n  \"counters\": {\n");
+    for(size_t i = 0; i < NB_COUNTERS; i++){
+      fprintf(f, "    \"%s\": ", counter_names[i]);
+      list(f, 2*NB_TIMERS + i, "%.0f");
+      fprintf(f, i + 1 < NB_COUNTERS ? ",\n" : "\n");
+    }
+    fprintf(f, "  }\n}\n");
+    if(fclose(f) != 0 || rename(tmp.c_str(), filename.c_str()) != 0)
+      std::cerr << "Could not write " << filename << endl;
+  };
+
+private:
+  std::array<std::atomic<uint64_t>, NB_TIMERS> nanoseconds, calls;
+  std::array<std::atomic<uint64_t>, NB_COUNTERS> counters;
+  wall_clock::time_point start;
+  const char* const timer_names[NB_TIMERS] = {
+    "metropolis_even", "metropolis_odd", "overrelaxation", "heatbath", "hmc",
+    "hmc_force", "halo_exchange", "cluster_growth", "cluster_flip",
+    "measurement", "fft", "checkpoint", "checkpoint_write", "observables"};
+  const char* const counter_names[NB_COUNTERS] = {
+    "metropolis_sweeps", "overrelaxation_sweeps", "overrelaxation_rejections",
+    "heatbath_sweeps", "heatbath_rejections", "hmc_trajectories",
+    "hmc_accepted", "cluster_updates", "clusters", "seed_retries",
+    "flipped_sites", "halo_exchanges", "measurements", "bytes_written"};
+
+}; // end of class definition
+
+// the timers and counters of this process
+inline Profile& profile() {
+  static Profile p;
+  return p;
+}
+
+// adds the time from its construction to its destruction to timer id
+class ScopedTimer {
+
+public:
+  ScopedTimer(const timer_id_t id) : id(id), begin(wall_clock::now()) {};
+  ~ScopedTimer() { profile().add_time(id, wall_clock::now() - begin); };
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+  const timer_id_t id;
+  const wall_clock::time_point begin;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // INSTRUMENTATION_H_
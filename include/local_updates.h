@@ -0,0 +1,228 @@
+#ifndef LOCAL_UPDATES_H_
+#define LOCAL_UPDATES_H_
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "instrumentation.h"
+#include "phi_field.h"
+#include "random_streams.h"
+#include "updates.h"
+
+namespace cluster {
+
+// Overrelaxation and heatbath sweeps on the structure-of-arrays field, the
+// local updates which can replace or complement the Metropolis sweep. Both
+// update one component at a time: with the other three components and the
+// neighbours fixed, the action of y = phi_c(x) is the quartic
+//
+//   P(y) = lambda y^4 + c y^2 - h y,  c = 1 + 2 lambda (a - 1),  h = 2 kappa N
+//
+// where a is the sum of the squares of the other components and N the sum of
+// component c over the eight neighbours. Sites of one parity are independent,
+// every site draws from its own stream (site, step) and the running sums are
+// kept up to date by update_sites in updates.h.
+
+// the steps of one iteration of the drivers, in the order of update_schedule
+typedef enum update_step_t {
+  STEP_METROPOLIS=0,
+  STEP_OVERRELAXATION,
+  STEP_HEATBATH,
+  STEP_HMC,
+  STEP_CLUSTER
+} update_step_t;
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the names of update_schedule, checked by IO_params
+inline std::vector<update_step_t> get_update_schedule(
+                                      const std::vector<std::string>& names){
+
+  std::vector<update_step_t> schedule;
+  for(const auto& name : names)
+    if(name == "metropolis")
+      schedule.push_back(STEP_METROPOLIS);
+    else if(name == "overrelaxation")
+      schedule.push_back(STEP_OVERRELAXATION);
+    else if(name == "heatbath")
+      schedule.push_back(STEP_HEATBATH);
+    else if(name == "hmc")
+      schedule.push_back(STEP_HMC);
+    else
+      schedule.push_back(STEP_CLUSTER);
+  return schedule;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the minimum of P, for h != 0 the one on the side of h. Newton from a point
+// above the root on that side, where P' is convex, so the iteration decreases
+// monotonically. A fixed number of steps keeps it a function of c and h only
+inline double quartic_minimum(const double c, const double h,
+                              const double lambda){
+
+  if(lambda <= 0.)
+    return .5*h/c;
+  const double b = fabs(h);
+  double y = sqrt(std::max(-c, 0.)/(2.*lambda)) + cbrt(b/(4.*lambda));
+  if(y > 0.)
+    for(int i = 0; i < 6; i++)
+      y -= (4.*lambda*y*y*y + 2.*c*y - b)/(12.*lambda*y*y + 2.*c);
+  return h < 0. ? -y : y;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the neighbour sum of component comp at x
+inline double neighbour_sum(const PhiField& phi, const size_t comp,
+                            const size_t x){
+
+  const real_t* const phi_comp = phi[comp];
+  double sum = 0.;
+  for(size_t dir = 0; dir < 4; dir++)
+    sum += phi_comp[phi.neighbour(dir, x)] + phi_comp[phi.neighbour(dir+4, x)];
+  return sum;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Overrelaxation of the local site x: every component is reflected about the
+// minimum m of its P, y -> 2m - y. The reflection is its own inverse and
+// keeps the measure, the move is accepted with min(1, exp(-dP)), which is
+// close to 1 where P is nearly symmetric about m. A random number is only
+// drawn if P grows. Returns the number of accepted reflections
+inline double overrelaxation_site(PhiField& phi, const size_t x,
+                                  RandomStream& random,
+                                  const double kappa, const double lambda,
+                                  FieldSums& change){
+
+  double acc = .0;
+  const PhiField::site_t before = phi.site(x);
+  auto phiSqr = before[0]*before[0] + before[1]*before[1] +
+                before[2]*before[2] + before[3]*before[3];
+  for(size_t comp = 0; comp < 4; comp++){
+    real_t* const phi_comp = phi[comp];
+    const double Phi = phi_comp[x];
+    const double c = 1. + 2.*lambda*(phiSqr - Phi*Phi - 1.);
+    const double h = 2.*kappa*neighbour_sum(phi, comp, x);
+    const double m = quartic_minimum(c, h, lambda);
+    const double reflected = real_t(2.*m - Phi); // the value which is stored
+    const double y2 = Phi*Phi, r2 = reflected*reflected;
+    const double dP = lambda*(r2*r2 - y2*y2) + c*(r2 - y2) -
+                      h*(reflected - Phi);
+    if(dP <= 0. || random.plain() < exp(-dP)){
+      phiSqr += r2 - y2;
+      phi_comp[x] = reflected;
+      acc++;
+    }
+  }
+  change.add_change(before, phi.site(x));
+
+  return acc;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Heatbath of the local site x: every component is drawn from exp(-P(y)) by
+// rejection. Since (y^2 - t)^2 >= 0, P(y) >= (c + 2 lambda t) y^2 - h y -
+// lambda t^2 for any t, so a Gaussian with that exponent is accepted with
+// exp(-lambda (y^2 - t)^2). t = m^2 puts the Gaussian where P is smallest; in
+// a deep double well t is raised until the Gaussian is not wider than the
+// wells. The new value does not depend on the old one. Returns the number of
+// rejected proposals
+inline double heatbath_site(PhiField& phi, const size_t x,
+                            RandomStream& random,
+                            const double kappa, const double lambda,
+                            FieldSums& change){
+
+  double rejected = .0;
+  const PhiField::site_t before = phi.site(x);
+  auto phiSqr = before[0]*before[0] + before[1]*before[1] +
+                before[2]*before[2] + before[3]*before[3];
+  for(size_t comp = 0; comp < 4; comp++){
+    real_t* const phi_comp = phi[comp];
+    const double Phi = phi_comp[x];
+    const double c = 1. + 2.*lambda*(phiSqr - Phi*Phi - 1.);
+    const double h = 2.*kappa*neighbour_sum(phi, comp, x);
+    double t = 0.;
+    if(lambda > 0.){
+      const double m = quartic_minimum(c, h, lambda);
+      t = std::max(m*m, (sqrt(lambda) - c)/(2.*lambda));
+    }
+    const double A = c + 2.*lambda*t;
+    const double mean = .5*h/A, sigma = sqrt(.5/A);
+    double y;
+    while(true){
+      const double radius = sqrt(-2.*log(1. - random.plain())); // Box-Muller
+      y = mean + sigma*radius*cos(2.*M_PI*random.plain());
+      const double d = y*y - t;
+      if(lambda <= 0. || random.plain() < exp(-lambda*d*d))
+        break;
+      rejected++;
+    }
+    y = real_t(y); // the value which is stored
+    phiSqr += y*y - Phi*Phi;
+    phi_comp[x] = y;
+  }
+  change.add_change(before, phi.site(x));
+
+  return rejected;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// one overrelaxation sweep, returns the acceptance in the units of
+// metropolis_update (accepted reflections/4)
+inline double overrelaxation_update(PhiField& phi, RandomStreams& streams,
+                                    const double kappa, const double lambda){
+
+  const uint64_t step = streams.next_step();
+  double acc = .0;
+  profile().count(COUNTER_OVERRELAXATION_SWEEPS);
+  for(int parity=EVEN; parity<=ODD; parity++) {
+    {
+      ScopedTimer timer(TIMER_OVERRELAXATION);
+      acc += update_sites(phi, phi.begin(parity), phi.end(parity), streams,
+                          step, [&](const size_t x, RandomStream& random,
+                                    FieldSums& change){
+        return overrelaxation_site(phi, x, random, kappa, lambda, change);
+      });
+    }
+    phi.update(parity); // communicate boundaries
+  }
+  profile().count(COUNTER_OVERRELAXATION_REJECTIONS,
+                  uint64_t(4*phi.local_volume() - acc));
+
+  return acc/4;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// one heatbath sweep
+inline void heatbath_update(PhiField& phi, RandomStreams& streams,
+                            const double kappa, const double lambda){
+
+  const uint64_t step = streams.next_step();
+  double rejected = .0;
+  profile().count(COUNTER_HEATBATH_SWEEPS);
+  for(int parity=EVEN; parity<=ODD; parity++) {
+    {
+      ScopedTimer timer(TIMER_HEATBATH);
+      rejected += update_sites(phi, phi.begin(parity), phi.end(parity),
+                               streams, step, [&](const size_t x,
+                                                  RandomStream& random,
+                                                  FieldSums& change){
+        return heatbath_site(phi, x, random, kappa, lambda, change);
+      });
+    }
+    phi.update(parity); // communicate boundaries
+  }
+  profile().count(COUNTER_HEATBATH_REJECTIONS, uint64_t(rejected));
+
+}
+
+} // end of namespace
+
+#endif // LOCAL_UPDATES_H_
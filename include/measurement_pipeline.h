@@ -0,0 +1,116 @@
+#ifndef MEASUREMENT_PIPELINE_H_
+#define MEASUREMENT_PIPELINE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "mdp.h"
+#include "measurements.h"
+
+namespace cluster {
+
+// Runs the measurements on snapshots of the field in a background thread, so
+// FFT, binning and file output overlap with the next updates.
+//
+// The update loop acquire()s a free snapshot, fills it and submit()s it; the
+// worker hands the snapshots to the consumer in the order they were
+// submitted. At most capacity snapshots are in flight, acquire() waits for
+// the worker when all of them are taken. With capacity 0 there is no thread
+// and submit() runs the consumer right away.
+//
+// The consumer communicates (FFT, reductions), and MPI is not initialised for
+// threads by mdp, so with PARALLEL the pipeline always runs synchronously.
+class MeasurementPipeline {
+
+public:
+  typedef std::function<void(const Snapshot&)> consumer_t;
+
+  MeasurementPipeline(size_t capacity, consumer_t consumer) :
+                                         consumer(consumer), stop(false) {
+#ifdef PARALLEL
+    if(capacity > 0)
+      mdp << "\tmeasurements run synchronously with several processes" << endl;
+    capacity = 0;
+#endif
+    synchronous = (capacity == 0);
+    snapshots.resize(synchronous ? 1 : capacity);
+    for(auto& s : snapshots)
+      free_snapshots.push_back(&s);
+    if(!synchronous)
+      worker = std::thread(&MeasurementPipeline::work, this);
+  };
+  ~MeasurementPipeline() { finish(); };
+  MeasurementPipeline(const MeasurementPipeline&) = delete;
+  MeasurementPipeline& operator=(const MeasurementPipeline&) = delete;
+
+  // a snapshot which is not in use, waits until the worker frees one
+  inline Snapshot& acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]{ return !free_snapshots.empty(); });
+    Snapshot* s = free_snapshots.front();
+    free_snapshots.pop_front();
+    return *s;
+  };
+  // hand a filled snapshot to the measurements
+  inline void submit(Snapshot& s) {
+    if(synchronous){
+      consumer(s);
+      std::lock_guard<std::mutex> lock(mutex);
+      free_snapshots.push_back(&s);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ready.push_back(&s);
+    changed.notify_all();
+  };
+  // process everything submitted so far and stop the worker
+  inline void finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    if(worker.joinable())
+      worker.join();
+  };
+
+private:
+  inline void work() {
+#ifdef _OPENMP
+    omp_set_num_threads(1); // the threads belong to the updates
+#endif
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+      changed.wait(lock, [this]{ return stop || !ready.empty(); });
+      if(ready.empty())
+        return; // stopped and drained
+      Snapshot* s = ready.front();
+      ready.pop_front();
+      lock.unlock();
+      consumer(*s);
+      lock.lock();
+      free_snapshots.push_back(s);
+      changed.notify_all();
+    }
+  };
+
+  consumer_t consumer;
+  bool synchronous, stop;
+  std::vector<Snapshot> snapshots;
+  std::deque<Snapshot*> free_snapshots, ready;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread worker;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // MEASUREMENT_PIPELINE_H_
@@ -0,0 +1,103 @@
+#ifndef MEASUREMENTS_H_
+#define MEASUREMENTS_H_
+
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "phi_field.h"
+#include "propagator_fft.h"
+
+namespace cluster {
+
+// Measurements straight from the structure-of-arrays field, or from a
+// snapshot of it: no rotation and no rescaled field. The global field
+// direction comes from the running sums, so the whole measurement is a single
+// pass over the local sites.
+
+// A copy of the local soa field and of what was measured with it, taken by
+// the update loop and handed to the measurements, possibly in another thread.
+struct Snapshot {
+
+  int iteration = 0;
+  size_t chain = 0; // of the ChainBundle, 0 for a single chain
+  double acceptance = 0., cluster_size = 0.;
+  FieldSums sums; // over the whole lattice
+  std::array<std::vector<double>, 4> comp; // local sites
+
+  // copy the local sites, the global sums need all processes
+  inline void take(const PhiField& phi) {
+    sums = phi.global_sums();
+    for(size_t c = 0; c < 4; c++)
+      comp[c].assign(phi[c], phi[c] + phi.local_volume());
+  };
+  inline double magnetisation() const {
+    return sqrt(sums.phi[0]*sums.phi[0] + sums.phi[1]*sums.phi[1] +
+                sums.phi[2]*sums.phi[2] + sums.phi[3]*sums.phi[3]);
+  };
+
+}; // end of struct definition
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// writes the Higgs projection and the four Goldstone components of
+// sqrt(2 kappa) phi into the slots of the propagator FFT - what Rescale and
+// Projection do on the mdp field. comp[c][x] are the components of the local
+// sites in soa order and dir the field summed over the whole lattice. Returns
+// the magnetisation |sum_x phi_x|.
+template<class T>
+inline double write_projections(const std::array<const T*, 4>& comp,
+                                const size_t local_volume,
+                                std::array<double, 4> dir,
+                                const double kappa, PropagatorFFT& fft){
+
+  const double M = sqrt(dir[0]*dir[0] + dir[1]*dir[1] +
+                        dir[2]*dir[2] + dir[3]*dir[3]);
+  for(size_t i = 0; i < 4; i++)
+    dir[i] /= M; // such that ||dir|| = 1
+  const double scale = sqrt(2.*kappa);
+  double* const output = fft.projections();
+
+  #pragma omp parallel for schedule(static)
+  for(size_t x = 0; x < local_volume; x++){
+    double* const out = output + 5*fft.slot(x);
+    const double p[4] = {scale*comp[0][x], scale*comp[1][x],
+                         scale*comp[2][x], scale*comp[3][x]};
+    // Higgs projection
+    const double higgs = p[0]*dir[0] + p[1]*dir[1] + p[2]*dir[2] + p[3]*dir[3];
+    out[0] = higgs;
+    // Goldstone projection
+    for(size_t i = 0; i < 4; i++)
+      out[1+i] = p[i] - higgs*dir[i];
+  }
+  return M;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the projections of the current field, the direction from its running sums
+inline double measure_projections(const PhiField& phi, const double kappa,
+                                  PropagatorFFT& fft){
+
+  return write_projections<real_t>({{phi[0], phi[1], phi[2], phi[3]}},
+                           phi.local_volume(), phi.global_sums().phi, kappa,
+                           fft);
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline double measure_projections(const Snapshot& snapshot, const double kappa,
+                                  PropagatorFFT& fft){
+
+  return write_projections<double>({{snapshot.comp[0].data(),
+                                     snapshot.comp[1].data(),
+                                     snapshot.comp[2].data(),
+                                     snapshot.comp[3].data()}},
+                                   snapshot.comp[0].size(), snapshot.sums.phi,
+                                   kappa, fft);
+
+}
+
+} // end of namespace
+
+#endif // MEASUREMENTS_H_
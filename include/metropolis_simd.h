@@ -0,0 +1,397 @@
+#ifndef METROPOLIS_SIMD_H_
+#define METROPOLIS_SIMD_H_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "instrumentation.h"
+#include "phi_field.h"
+#include "random_streams.h"
+#include "updates.h"
+
+namespace cluster {
+
+// Vectorised multihit Metropolis on the structure-of-arrays field. One SIMD
+// lane carries one site, a chunk of 4 (AVX2) or 8 (AVX-512) consecutive sites
+// of the same parity is updated at once. Sites of one parity only couple to
+// the other parity, so the lanes are independent and the acceptance and the
+// distributions are the ones of the scalar kernel. Each lane reads the same
+// counter-based stream its site would use in the scalar kernel, bulk filled
+// into a buffer before the chunk is updated, so both kernels agree up to the
+// rounding of the vectorised exp. Which kernels exist depends on the -m flags
+// at compile time. The kernels only use the functions of the simd_* structs,
+// which wrap the intrinsics of one instruction set.
+
+typedef enum metropolis_kernel_t {
+  METROPOLIS_SCALAR=0,
+  METROPOLIS_AVX2,
+  METROPOLIS_AVX512
+} metropolis_kernel_t;
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline metropolis_kernel_t get_metropolis_kernel(const std::string& name){
+
+  if(name == "avx2"){
+#if defined(__AVX2__)
+    return METROPOLIS_AVX2;
+#endif
+  }
+  else if(name == "avx512"){
+#if defined(__AVX512F__)
+    return METROPOLIS_AVX512;
+#endif
+  }
+  else
+    return METROPOLIS_SCALAR;
+  mdp << "metropolis_kernel = " << name
+      << " is not available in this build, check the -m flags!" << endl;
+  exit(0);
+
+}
+
+#if defined(__AVX2__)
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+struct simd_avx2 {
+  typedef __m256d vec;
+  typedef __m256d mask;
+  static const size_t width = 4;
+
+  static inline vec set1(const double a) { return _mm256_set1_pd(a); };
+  static inline vec add(const vec a, const vec b) {
+    return _mm256_add_pd(a, b);
+  };
+  static inline vec sub(const vec a, const vec b) {
+    return _mm256_sub_pd(a, b);
+  };
+  static inline vec mul(const vec a, const vec b) {
+    return _mm256_mul_pd(a, b);
+  };
+  static inline vec load(const double* p) { return _mm256_loadu_pd(p); };
+  static inline void store(double* p, const vec a) { _mm256_storeu_pd(p, a); };
+  static inline vec gather(const double* base, const int* idx) {
+    return _mm256_i32gather_pd(base,
+                         _mm_loadu_si128((const __m128i*) idx), 8);
+  };
+  // single precision storage, widened to double in the registers
+  static inline vec load(const float* p) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+  };
+  static inline void store(float* p, const vec a) {
+    _mm_storeu_ps(p, _mm256_cvtpd_ps(a));
+  };
+  static inline vec gather(const float* base, const int* idx) {
+    return _mm256_cvtps_pd(_mm_i32gather_ps(base,
+                         _mm_loadu_si128((const __m128i*) idx), 4));
+  };
+  // a rounded to the stored precision
+  static inline vec rounded(const vec a) {
+#ifdef FLOAT_FIELD
+    return _mm256_cvtps_pd(_mm256_cvtpd_ps(a));
+#else
+    return a;
+#endif
+  };
+  static inline mask less(const vec a, const vec b) {
+    return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+  };
+  static inline vec select(const mask m, const vec if_false,
+                           const vec if_true) {
+    return _mm256_blendv_pd(if_false, if_true, m);
+  };
+  static inline vec count(const vec acc, const mask m) {
+    return _mm256_add_pd(acc, _mm256_and_pd(m, set1(1.)));
+  };
+  static inline double sum(const vec a) {
+    alignas(32) double t[4];
+    _mm256_store_pd(t, a);
+    return t[0] + t[1] + t[2] + t[3];
+  };
+  // exp(x) by range reduction x = n*ln2 + r and a Taylor polynomial in r
+  static inline vec exp(vec x) {
+    x = _mm256_max_pd(_mm256_min_pd(x, set1(708.)), set1(-708.));
+    const vec n = _mm256_round_pd(_mm256_mul_pd(x, set1(1.4426950408889634)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const vec r = _mm256_sub_pd(_mm256_sub_pd(x,
+                    _mm256_mul_pd(n, set1(6.93145751953125E-1))),
+                    _mm256_mul_pd(n, set1(1.42860682030941723212E-6)));
+    vec p = set1(1./39916800.);
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./3628800.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./362880.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./40320.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./5040.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./720.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./120.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./24.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./6.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1./2.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1.));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), set1(1.));
+    const __m256i e = _mm256_slli_epi64(_mm256_add_epi64(
+                        _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n)),
+                        _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+  };
+};
+#endif // __AVX2__
+
+#if defined(__AVX512F__)
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+struct simd_avx512 {
+  typedef __m512d vec;
+  typedef __mmask8 mask;
+  static const size_t width = 8;
+
+  static inline vec set1(const double a) { return _mm512_set1_pd(a); };
+  static inline vec add(const vec a, const vec b) {
+    return _mm512_add_pd(a, b);
+  };
+  static inline vec sub(const vec a, const vec b) {
+    return _mm512_sub_pd(a, b);
+  };
+  static inline vec mul(const vec a, const vec b) {
+    return _mm512_mul_pd(a, b);
+  };
+  static inline vec load(const double* p) { return _mm512_loadu_pd(p); };
+  static inline void store(double* p, const vec a) { _mm512_storeu_pd(p, a); };
+  static inline vec gather(const double* base, const int* idx) {
+    return _mm512_i32gather_pd(
+                 _mm256_loadu_si256((const __m256i*) idx), base, 8);
+  };
+  // single precision storage, widened to double in the registers
+  static inline vec load(const float* p) {
+    return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+  };
+  static inline void store(float* p, const vec a) {
+    _mm256_storeu_ps(p, _mm512_cvtpd_ps(a));
+  };
+  static inline vec gather(const float* base, const int* idx) {
+    return _mm512_cvtps_pd(_mm256_i32gather_ps(base,
+                 _mm256_loadu_si256((const __m256i*) idx), 4));
+  };
+  // a rounded to the stored precision
+  static inline vec rounded(const vec a) {
+#ifdef FLOAT_FIELD
+    return _mm512_cvtps_pd(_mm512_cvtpd_ps(a));
+#else
+    return a;
+#endif
+  };
+  static inline mask less(const vec a, const vec b) {
+    return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+  };
+  static inline vec select(const mask m, const vec if_false,
+                           const vec if_true) {
+    return _mm512_mask_blend_pd(m, if_false, if_true);
+  };
+  static inline vec count(const vec acc, const mask m) {
+    return _mm512_mask_add_pd(acc, m, acc, set1(1.));
+  };
+  static inline double sum(const vec a) { return _mm512_reduce_add_pd(a); };
+  // exp(x) by range reduction x = n*ln2 + r and a Taylor polynomial in r
+  static inline vec exp(vec x) {
+    x = _mm512_max_pd(_mm512_min_pd(x, set1(708.)), set1(-708.));
+    const vec n = _mm512_roundscale_pd(_mm512_mul_pd(x,
+                    set1(1.4426950408889634)), _MM_FROUND_TO_NEAREST_INT);
+    const vec r = _mm512_sub_pd(_mm512_sub_pd(x,
+                    _mm512_mul_pd(n, set1(6.93145751953125E-1))),
+                    _mm512_mul_pd(n, set1(1.42860682030941723212E-6)));
+    vec p = set1(1./39916800.);
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./3628800.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./362880.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./40320.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./5040.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./720.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./120.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./24.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./6.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1./2.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1.));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), set1(1.));
+    return _mm512_scalef_pd(p, n);
+  };
+};
+#endif // __AVX512F__
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the lanes of metropolis_chunk: the local sites [x, x+width) of one parity,
+// the changes of all of them go to one FieldSums
+template<class S>
+struct SiteLanes {
+  PhiField& phi;
+  const size_t x;
+  FieldSums& sums;
+
+  inline typename S::vec load(const size_t comp) const {
+    return S::load(phi[comp] + x);
+  };
+  inline void store(const size_t comp, const typename S::vec a) const {
+    S::store(phi[comp] + x, a);
+  };
+  inline typename S::vec neighbour(const size_t comp, const size_t dir) const {
+    return S::gather(phi[comp], phi.neighbours(dir) + x);
+  };
+  inline PhiField::site_t site(const size_t lane) const {
+    return phi.site(x + lane);
+  };
+  inline FieldSums& change(const size_t) const { return sums; };
+};
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// multihit on the lanes of L (SiteLanes or ChainLanes) with the couplings
+// kappa and lambda of every lane, returns accepted hits and adds the changes
+// of the field sums lane by lane, in the order of the scalar kernel. rnd
+// holds the random numbers of all lanes interleaved, rnd[k*width + lane]
+template<class S, class L>
+inline typename S::vec metropolis_chunk(const L& lanes, const double* rnd,
+                                        const typename S::vec kappa,
+                                        const typename S::vec lambda,
+                                        const double delta,
+                                        const size_t nb_of_hits){
+
+  typedef typename S::vec vec;
+  const vec zero = S::set1(0.), one = S::set1(1.), two = S::set1(2.);
+  const vec four = S::set1(4.), vdelta = S::set1(delta);
+  const vec vkappa = S::mul(two, kappa), vlambda = lambda;
+  const vec vlambda2 = S::mul(two, lambda);
+
+  vec acc = zero;
+  PhiField::site_t before[S::width];
+  for(size_t lane = 0; lane < S::width; lane++)
+    before[lane] = lanes.site(lane);
+  // computing phi^2 on x
+  vec phiSqr = zero;
+  for(size_t comp = 0; comp < 4; comp++){
+    const vec p = lanes.load(comp);
+    phiSqr = S::add(phiSqr, S::mul(p, p));
+  }
+  for(size_t comp = 0; comp < 4; comp++){
+    vec Phi = lanes.load(comp);
+    // compute the neighbour sum
+    vec neighbourSum = zero;
+    for(size_t dir = 0; dir < 4; dir++)
+      neighbourSum = S::add(neighbourSum, S::add(lanes.neighbour(comp, dir),
+                                                 lanes.neighbour(comp, dir+4)));
+    // doing the multihit, all lanes at once
+    for(size_t hit = 0; hit < nb_of_hits; hit++){
+      const vec deltaPhi = S::mul(S::sub(S::mul(S::load(rnd), two), one),
+                                  vdelta);
+      const vec deltaPhiPhi = S::mul(deltaPhi, Phi);
+      const vec deltaPhideltaPhi = S::mul(deltaPhi, deltaPhi);
+      // change of action, term by term in the order of metropolis_site
+      const vec hopping = S::sub(zero, S::mul(S::mul(vkappa, deltaPhi),
+                                              neighbourSum));
+      const vec linear = S::mul(S::mul(two, deltaPhiPhi),
+                          S::sub(one, S::mul(vlambda2,
+                            S::sub(S::sub(one, phiSqr), deltaPhideltaPhi))));
+      const vec quadratic = S::mul(deltaPhideltaPhi,
+                          S::sub(one, S::mul(vlambda2, S::sub(one, phiSqr))));
+      const vec quartic = S::mul(vlambda,
+                          S::add(S::mul(S::mul(four, deltaPhiPhi), deltaPhiPhi),
+                                 S::mul(deltaPhideltaPhi, deltaPhideltaPhi)));
+      const vec dS = S::add(S::add(S::add(hopping, linear), quadratic),
+                            quartic);
+      // accept reject step in every lane
+      const typename S::mask accept =
+                   S::less(S::load(rnd + S::width), S::exp(S::sub(zero, dS)));
+      rnd += 2*S::width;
+      const vec newPhi = S::rounded(S::add(Phi, deltaPhi));
+      phiSqr = S::select(accept, phiSqr,
+                         S::add(S::sub(phiSqr, S::mul(Phi, Phi)),
+                                S::mul(newPhi, newPhi)));
+      Phi = S::select(accept, Phi, newPhi);
+      acc = S::count(acc, accept);
+    } // multi hit ends here
+    lanes.store(comp, Phi);
+  } // loop over components ends here
+  for(size_t lane = 0; lane < S::width; lane++)
+    lanes.change(lane).add_change(before[lane], lanes.site(lane));
+  return acc;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+template<class S>
+double metropolis_sweep_simd(PhiField& phi, RandomStreams& streams,
+                             const double kappa, const double lambda,
+                             const double delta, const size_t nb_of_hits){
+
+  const uint64_t step = streams.next_step();
+  const size_t nb_random = 8*nb_of_hits; // per site
+  double acc = 0.;
+  profile().count(COUNTER_METROPOLIS_SWEEPS);
+  for(int parity=EVEN; parity<=ODD; parity++) {
+    const wall_clock::time_point parity_begin = wall_clock::now();
+    const size_t first = phi.begin(parity), last = phi.end(parity);
+    // the same blocks as in metropolis_sites, a multiple of the chunk size
+    const size_t nb_blocks = (last - first + sums_block - 1)/sums_block;
+    std::vector<FieldSums> change(nb_blocks);
+    // chunks of one parity are independent, each thread fills its own buffer
+    #pragma omp parallel reduction(+:acc)
+    {
+      std::vector<double> rnd(nb_random*S::width);
+      #pragma omp for schedule(static)
+      for(size_t block = 0; block < nb_blocks; block++){
+        const size_t block_end = std::min(first + (block+1)*sums_block, last);
+        size_t x = first + block*sums_block;
+        for(; x + S::width <= block_end; x += S::width){
+          streams.fill_lanes<S::width>(step, phi.global_indices() + x,
+                                       rnd.data(), nb_random);
+          acc += S::sum(metropolis_chunk<S>(
+                          SiteLanes<S>{phi, x, change[block]}, rnd.data(),
+                          S::set1(kappa), S::set1(lambda), delta, nb_of_hits));
+        }
+        // sites which do not fill a whole chunk are done by the scalar code
+        for(; x < block_end; x++){
+          RandomStream random = streams.stream(step, phi.global_index(x));
+          acc += metropolis_site(phi, x, random, kappa, lambda, delta,
+                                 nb_of_hits, change[block]);
+        }
+      }
+    }
+    for(const auto& c : change)
+      phi.add_to_sums(c);
+    profile().add_time(parity == EVEN ? TIMER_METROPOLIS_EVEN :
+                       TIMER_METROPOLIS_ODD, wall_clock::now() - parity_begin);
+    phi.update(parity); // communicate boundaries
+  }
+
+  return acc/(4*nb_of_hits);
+
+}
+#endif // __AVX2__ || __AVX512F__
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline double metropolis_update(PhiField& phi, RandomStreams& streams,
+                                const metropolis_kernel_t kernel,
+                                const double kappa, const double lambda,
+                                const double delta, const size_t nb_of_hits){
+
+  switch(kernel){
+#if defined(__AVX512F__)
+    case METROPOLIS_AVX512:
+      return metropolis_sweep_simd<simd_avx512>(phi, streams, kappa, lambda,
+                                                delta, nb_of_hits);
+#endif
+#if defined(__AVX2__)
+    case METROPOLIS_AVX2:
+      return metropolis_sweep_simd<simd_avx2>(phi, streams, kappa, lambda,
+                                              delta, nb_of_hits);
+#endif
+    default:
+      return metropolis_update(phi, streams, kappa, lambda, delta, nb_of_hits);
+  }
+
+}
+
+} // end of namespace
+
+#endif // METROPOLIS_SIMD_H_
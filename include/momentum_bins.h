@@ -0,0 +1,123 @@
+#ifndef MOMENTUM_BINS_H_
+#define MOMENTUM_BINS_H_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+#include <fftw3.h>
+
+namespace cluster {
+
+// Index from the momenta of the 4d FFT to the distinct values of
+// p^2 = 4 sum_mu sin^2(p_mu/2), p_mu = 2 pi n_mu/L_mu, built once by sorting.
+// The FFT is real-to-complex, so momentum index i is the row-major index of
+// (n_0, n_1, n_2, n_3) with n_3 <= L_3/2. The momentum -n has the same p^2 and
+// |FFT|^2, which is why every stored momentum with 0 < n_3 < L_3/2 counts
+// twice. Two momenta share a bin when their p^2 differ by less than 1e-9, the
+// tolerance of the old linear search.
+//
+// accumulate() then bins the Higgs and Goldstone propagators of all momenta
+// in one pass over the FFT output.
+class MomentumBins {
+
+public:
+  MomentumBins(const int L[4]) : V(size_t(L[0])*L[1]*L[2]*L[3]),
+                                 bin_of(V/L[3]*(L[3]/2+1)),
+                                 weight(bin_of.size()) {
+
+    // p^2 of every stored momentum
+    std::vector<double> sinPSqr(bin_of.size());
+    std::array<double, 4> p;
+    size_t i = 0;
+    for(int x0 = 0; x0 < L[0]; x0++){
+      p[0] = x0*M_PI/L[0]; // half-momentum
+      for(int x1 = 0; x1 < L[1]; x1++){
+        p[1] = x1*M_PI/L[1];
+        for(int x2 = 0; x2 < L[2]; x2++){
+          p[2] = x2*M_PI/L[2];
+          for(int x3 = 0; x3 <= L[3]/2; x3++){
+            p[3] = x3*M_PI/L[3];
+            weight[i] = (x3 == 0 || 2*x3 == L[3]) ? 1 : 2;
+            sinPSqr[i++] = 4.0 * (sin(p[0])*sin(p[0]) + sin(p[1])*sin(p[1]) +
+                                  sin(p[2])*sin(p[2]) + sin(p[3])*sin(p[3]));
+          }
+        }
+      }
+    }
+    // sort once, equal values are neighbours then
+    std::vector<size_t> order(bin_of.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b){
+      return sinPSqr[a] < sinPSqr[b];
+    });
+    for(const auto& i : order){
+      if(momentum.empty() || fabs(sinPSqr[i] - momentum.back()) >= 1E-9){
+        momentum.push_back(sinPSqr[i]);
+        count.push_back(0);
+      }
+      bin_of[i] = momentum.size() - 1;
+      count.back() += weight[i];
+    }
+  };
+
+  // number of distinct p^2
+  inline size_t size() const { return momentum.size(); };
+  // the distinct p^2 in ascending order
+  inline const std::vector<double>& momenta() const { return momentum; };
+  // number of stored momenta, the size of one r2c transform
+  inline size_t half_volume() const { return bin_of.size(); };
+  // bin of momentum index i
+  inline int bin(const size_t i) const { return bin_of[i]; };
+
+  // output holds 5 interleaved transforms of the momenta [first, first+n),
+  // output[5*i + 0] the Higgs and output[5*i + 1..4] the Goldstone
+  // projection of momentum first+i. Adds their |FFT|^2 to the bins, a part
+  // of the momenta can be added on every process
+  inline void add(fftw_complex const * const output, const size_t first,
+                  const size_t n, std::vector<double>& higgs,
+                  std::vector<double>& goldstone) const {
+
+    for(size_t i = 0; i < n; i++){
+      const int b = bin_of[first+i];
+      higgs[b] += weight[first+i] * (output[5*i][0]*output[5*i][0] +
+                                     output[5*i][1]*output[5*i][1]);
+      double g = 0.0;
+      for(size_t c = 1; c < 5; c++)
+        g += output[5*i+c][0]*output[5*i+c][0] +
+             output[5*i+c][1]*output[5*i+c][1];
+      goldstone[b] += weight[first+i] * g;
+    }
+  };
+  // turns the sums over all momenta into the propagators averaged per bin
+  inline void normalise(std::vector<double>& higgs,
+                        std::vector<double>& goldstone) const {
+    for(size_t b = 0; b < size(); b++){
+      higgs[b] /= double(V)*count[b];
+      goldstone[b] /= 3.*V*count[b];
+    }
+  };
+  // higgs[b] and goldstone[b] receive the propagators averaged over the
+  // momenta in bin b, output holds all stored momenta
+  inline void accumulate(fftw_complex const * const output,
+                         std::vector<double>& higgs,
+                         std::vector<double>& goldstone) const {
+    higgs.assign(size(), 0.0);
+    goldstone.assign(size(), 0.0);
+    add(output, 0, half_volume(), higgs, goldstone);
+    normalise(higgs, goldstone);
+  };
+
+private:
+  const size_t V;
+  std::vector<int> bin_of, weight;
+  std::vector<double> momentum;
+  std::vector<size_t> count;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // MOMENTUM_BINS_H_
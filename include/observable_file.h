@@ -0,0 +1,322 @@
+#ifndef OBSERVABLE_FILE_H_
+#define OBSERVABLE_FILE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mdp.h"
+#include "instrumentation.h"
+#include "IO_params.h"
+
+namespace cluster {
+
+// One binary file per run which holds every observable. All fields are
+// native endian and 8-byte aligned, so the file can be mapped and used in
+// place:
+//
+//   header   char magic[8] = "PHI4OBS", uint32 version, uint32 header_bytes,
+//            int32 L[4], double kappa, double lambda, int32 seed,
+//            int32 replica, uint32 nb_observables, uint32 record_bytes,
+//            nb_observables x {char name[24], uint32 offset, uint32 length},
+//            uint32 nb_momenta, uint32 unused, double momenta[nb_momenta]
+//   chunks   char tag[4] = "CHNK", uint32 nb_records,
+//            nb_records x {int64 iteration, double values[]}
+//
+// Observable k of a record are the doubles values[offset_k, offset_k +
+// length_k), e.g. one propagator per momentum of the momentum table.
+// Records are collected in memory and written a chunk at a time, a crash
+// loses at most the unwritten chunk. A run restarted from the checkpoint of
+// iteration N appends to its file, which needs the same header; the records
+// after N, which the run before the restart wrote, and a chunk which was
+// cut off are dropped. A different header is an error instead of mixing two
+// runs.
+struct Observable {
+  std::string name;
+  uint32_t length;
+};
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+class ObservableFile {
+
+public:
+  // only process 0 writes, on the others the object does nothing. With
+  // resume_after >= 0 the records up to that iteration are kept
+  ObservableFile(const std::string& filename, const LatticeDataContainer& data,
+                 const std::vector<Observable>& observables,
+                 const std::vector<double>& momenta = std::vector<double>(),
+                 const int64_t resume_after = -1,
+                 const size_t chunk_records = 64) :
+                                  filename(filename), file(NULL),
+                                  chunk_records(chunk_records), nb_values(0),
+                                  in_record(0) {
+
+    if(mdp.me() != 0)
+      return;
+    for(const auto& o : observables)
+      nb_values += o.length;
+    std::vector<char> header = make_header(data, observables, momenta);
+
+    if(resume_after < 0 || !resume(header, resume_after)){
+      file = fopen(filename.c_str(), "wb");
+      if(file == NULL || fwrite(header.data(), 1, header.size(), file) !=
+                         header.size()){
+        std::cerr << "Could not create " << filename << endl;
+        exit(1);
+      }
+      fflush(file);
+    }
+    chunk.reserve(chunk_records*(nb_values + 1));
+  };
+  ~ObservableFile() { close(); };
+  ObservableFile(const ObservableFile&) = delete;
+  ObservableFile& operator=(const ObservableFile&) = delete;
+
+  // starts a new record, the values of all observables follow with put() in
+  // the order in which the observables were declared
+  inline void record(const int64_t iteration) {
+    if(file == NULL)
+      return;
+    check_complete();
+    if(chunk.size() == chunk_records*(nb_values + 1))
+      flush();
+    double it;
+    memcpy(&it, &iteration, sizeof(it));
+    chunk.push_back(it);
+    in_record = nb_values;
+  };
+  inline void put(const double value) {
+    if(file == NULL)
+      return;
+    if(in_record == 0){
+      std::cerr << "Too many values for a record in " << filename << endl;
+      exit(1);
+    }
+    chunk.push_back(value);
+    in_record--;
+  };
+  inline void put(const std::vector<double>& values) {
+    for(const auto& v : values)
+      put(v);
+  };
+
+  // writes all complete records as one chunk
+  inline void flush() {
+    if(file == NULL || chunk.empty())
+      return;
+    ScopedTimer timer(TIMER_OBSERVABLES);
+    check_complete();
+    const uint32_t nb_records = chunk.size()/(nb_values + 1);
+    fwrite("CHNK", 1, 4, file);
+    fwrite(&nb_records, sizeof(uint32_t), 1, file);
+    fwrite(chunk.data(), sizeof(double), chunk.size(), file);
+    fflush(file);
+    profile().count(COUNTER_BYTES_WRITTEN, 8 + chunk.size()*sizeof(double));
+    chunk.clear();
+  };
+  inline void close() {
+    if(file == NULL)
+      return;
+    flush();
+    fclose(file);
+    file = NULL;
+  };
+
+private:
+  inline void check_complete() const {
+    if(in_record != 0){
+      std::cerr << "Incomplete record in " << filename << endl;
+      exit(1);
+    }
+  };
+  template<class T>
+  static inline void append(std::vector<char>& buffer, const T& value) {
+    const char* p = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), p, p + sizeof(T));
+  }
+  inline std::vector<char> make_header(const LatticeDataContainer& data,
+                                 const std::vector<Observable>& observables,
+                                 const std::vector<double>& momenta) const {
+    std::vector<char> h;
+    const char magic[8] = "PHI4OBS";
+    h.insert(h.end(), magic, magic + 8);
+    append(h, uint32_t(1)); // version
+    append(h, uint32_t(0)); // header_bytes, set below
+    for(size_t i = 0; i < 4; i++)
+      append(h, int32_t(data.L[i]));
+    append(h, data.kappa);
+    append(h, data.lambda);
+    append(h, int32_t(data.seed));
+    append(h, int32_t(data.replica));
+    append(h, uint32_t(observables.size()));
+    append(h, uint32_t(8*(nb_values + 1)));
+    uint32_t offset = 0;
+    for(const auto& o : observables){
+      char name[24] = {0};
+      strncpy(name, o.name.c_str(), sizeof(name) - 1);
+      h.insert(h.end(), name, name + sizeof(name));
+      append(h, offset);
+      append(h, o.length);
+      offset += o.length;
+    }
+    append(h, uint32_t(momenta.size()));
+    append(h, uint32_t(0));
+    for(const auto& m : momenta)
+      append(h, m);
+    const uint32_t header_bytes = h.size();
+    memcpy(h.data() + 12, &header_bytes, sizeof(header_bytes));
+    return h;
+  };
+  // appends to an existing file of the same run after the last record up to
+  // iteration last, drops the records behind it and a cut off chunk
+  inline bool resume(const std::vector<char>& header, const int64_t last) {
+    FILE* f = fopen(filename.c_str(), "r+b");
+    if(f == NULL)
+      return false;
+    std::vector<char> existing(header.size());
+    const bool same = fread(existing.data(), 1, existing.size(), f) ==
+                      existing.size() && existing == header;
+    if(!same){
+      fclose(f);
+      std::cerr << filename << " belongs to a different run, "
+                << "not appending to it!" << endl;
+      exit(1);
+    }
+    // walk the complete chunks up to the first record after last
+    const long record_bytes = 8*(nb_values + 1);
+    long good = header.size();
+    char tag[4];
+    uint32_t nb_records;
+    int64_t iteration;
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, good, SEEK_SET);
+    while(fread(tag, 1, 4, f) == 4 && memcmp(tag, "CHNK", 4) == 0 &&
+          fread(&nb_records, sizeof(uint32_t), 1, f) == 1){
+      const long begin = good;
+      if(begin + 8 + long(nb_records)*record_bytes > size)
+        break;
+      uint32_t kept = 0;
+      while(kept < nb_records){
+        fseek(f, begin + 8 + long(kept)*record_bytes, SEEK_SET);
+        if(fread(&iteration, sizeof(int64_t), 1, f) != 1 || iteration > last)
+          break;
+        kept++;
+      }
+      if(kept == 0)
+        break;
+      good = begin + 8 + long(kept)*record_bytes;
+      if(kept < nb_records){ // the chunk ends after the kept records
+        fseek(f, begin + 4, SEEK_SET);
+        fwrite(&kept, sizeof(uint32_t), 1, f);
+        break;
+      }
+      fseek(f, good, SEEK_SET);
+    }
+    if(fclose(f) != 0 ||
+       (good != size && truncate(filename.c_str(), good) != 0)){
+      std::cerr << "Could not repair " << filename << endl;
+      exit(1);
+    }
+    file = fopen(filename.c_str(), "ab");
+    return file != NULL;
+  };
+
+  const std::string filename;
+  FILE* file;
+  const size_t chunk_records;
+  size_t nb_values, in_record;
+  std::vector<double> chunk;
+
+}; // end of class definition
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// read access to an observable file through mmap, no copies
+class ObservableReader {
+
+public:
+  ObservableReader(const std::string& filename) : data(NULL), size(0) {
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < 24){
+      std::cerr << "Could not open " << filename << endl;
+      exit(1);
+    }
+    size = st.st_size;
+    void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED || memcmp(p, "PHI4OBS", 8) != 0){
+      std::cerr << filename << " is not an observable file" << endl;
+      exit(1);
+    }
+    data = static_cast<const char*>(p);
+    const uint32_t header_bytes = field<uint32_t>(12);
+    nb_observables = field<uint32_t>(56);
+    record_bytes = field<uint32_t>(60);
+    nb_momenta = field<uint32_t>(64 + 32*nb_observables);
+    // index of the records, chunk by chunk
+    size_t pos = header_bytes;
+    while(pos + 8 <= size && memcmp(data + pos, "CHNK", 4) == 0){
+      const uint32_t n = field<uint32_t>(pos + 4);
+      if(pos + 8 + size_t(n)*record_bytes > size)
+        break;
+      for(uint32_t r = 0; r < n; r++)
+        records.push_back(pos + 8 + size_t(r)*record_bytes);
+      pos += 8 + size_t(n)*record_bytes;
+    }
+  };
+  ~ObservableReader() { munmap(const_cast<char*>(data), size); };
+  ObservableReader(const ObservableReader&) = delete;
+  ObservableReader& operator=(const ObservableReader&) = delete;
+
+  inline int L(const size_t mu) const { return field<int32_t>(16 + 4*mu); };
+  inline double kappa() const { return field<double>(32); };
+  inline double lambda() const { return field<double>(40); };
+  inline int seed() const { return field<int32_t>(48); };
+  inline int replica() const { return field<int32_t>(52); };
+  inline const double* momenta() const {
+    return reinterpret_cast<const double*>(data + 72 + 32*nb_observables);
+  };
+  inline size_t nb_of_momenta() const { return nb_momenta; };
+
+  inline size_t nb_records() const { return records.size(); };
+  inline int64_t iteration(const size_t r) const {
+    return field<int64_t>(records[r]);
+  };
+  // the values of observable name in record r, NULL if there is no such one
+  inline const double* operator()(const std::string& name,
+                                  const size_t r) const {
+    for(uint32_t k = 0; k < nb_observables; k++)
+      if(name == std::string(data + 64 + 32*k))
+        return reinterpret_cast<const double*>(data + records[r] + 8) +
+               field<uint32_t>(64 + 32*k + 24);
+    return NULL;
+  };
+
+private:
+  template<class T>
+  inline T field(const size_t offset) const {
+    T value;
+    memcpy(&value, data + offset, sizeof(T));
+    return value;
+  }
+
+  const char* data;
+  size_t size;
+  uint32_t nb_observables, record_bytes, nb_momenta;
+  std::vector<size_t> records;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // OBSERVABLE_FILE_H_
@@ -0,0 +1,245 @@
+#ifndef PHI_FIELD_H_
+#define PHI_FIELD_H_
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "mdp.h"
+#include "instrumentation.h"
+
+namespace cluster {
+
+// Sums of phi, phi^2 and phi^4 over a set of sites, or the change of these
+// sums by an update.
+struct FieldSums {
+
+  std::array<double, 4> phi = {{0., 0., 0., 0.}};
+  double phi2 = 0., phi4 = 0.;
+
+  inline FieldSums& operator+=(const FieldSums& other) {
+    for(size_t c = 0; c < 4; c++)
+      phi[c] += other.phi[c];
+    phi2 += other.phi2;
+    phi4 += other.phi4;
+    return *this;
+  };
+  // one site changed from before to after
+  inline void add_change(const std::array<double, 4>& before,
+                         const std::array<double, 4>& after) {
+    for(size_t c = 0; c < 4; c++)
+      phi[c] += after[c] - before[c];
+    const double sqr_before = before[0]*before[0] + before[1]*before[1] +
+                              before[2]*before[2] + before[3]*before[3];
+    const double sqr_after = after[0]*after[0] + after[1]*after[1] +
+                             after[2]*after[2] + after[3]*after[3];
+    phi2 += sqr_after - sqr_before;
+    phi4 += sqr_after*sqr_after - sqr_before*sqr_before;
+  };
+
+}; // end of struct definition
+
+// The site loops of the updates are cut into blocks of this many sites. The
+// changes of the running sums are added up inside a block and then block by
+// block, so the sums do not depend on the number of threads or on the kernel.
+// A multiple of every SIMD width.
+const size_t sums_block = 64;
+
+// Type of the stored field components. Compiled with -DFLOAT_FIELD the soa
+// field is kept in single precision, which halves the memory traffic of the
+// updates. Everything computed from it - action differences, accept/reject,
+// running sums, reductions and measurements - stays in double, the values
+// are only rounded when they are stored. The mdp field, checkpoints and
+// snapshots remain double.
+#ifdef FLOAT_FIELD
+typedef float real_t;
+#else
+typedef double real_t;
+#endif
+
+// One field in the component arrays of a PhiField or a ChainBundle
+// (chain_bundle.h): component c of local site x is comp[c][x*stride +
+// offset]. The update kernels work on this view, so the same code runs on a
+// single field and on the interleaved chains.
+struct FieldView {
+
+  std::array<real_t*, 4> comp;
+  size_t stride, offset;
+
+  inline size_t index(const size_t x) const { return x*stride + offset; };
+  inline std::array<double, 4> site(const size_t x) const {
+    const size_t i = index(x);
+    return {{comp[0][i], comp[1][i], comp[2][i], comp[3][i]}};
+  };
+
+}; // end of struct definition
+
+// Structure-of-arrays copy of the phi field. The four components are stored
+// in separate contiguous arrays and the neighbours of every local site are
+// kept in a flat table, so the update kernels never touch mdp_site arithmetic.
+//
+// Sites are relabelled such that all local sites of one parity are
+// contiguous: [begin(EVEN), end(EVEN)) and [begin(ODD), end(ODD)), followed
+// by the halo copies of the neighbouring processes up to nvol(). The ordering
+// inside one parity is the one of forallsitesofparity.
+//
+// The mdp_field stays the reference for communication and I/O: update()
+// sends one parity through phi.update(parity), store()/load() synchronise
+// the two copies.
+//
+// The sums of phi, phi^2 and phi^4 over the local sites are kept up to date
+// by the update kernels, which makes magnetisation and field direction O(1).
+// load() recomputes them from scratch, which also removes the rounding drift
+// of a long run.
+class PhiField {
+
+public:
+  typedef std::array<double, 4> site_t;
+
+  PhiField(mdp_field<site_t>& phi, mdp_site& x) : phi(phi) {
+
+    const size_t nvol = x.lattice().nvol;
+    soa_index.assign(nvol, -1);
+    mdp_index.reserve(nvol);
+    // local sites, parity by parity
+    for(int parity = EVEN; parity <= ODD; parity++){
+      first[parity] = mdp_index.size();
+      forallsitesofparity(x, parity){
+        soa_index[x.idx] = mdp_index.size();
+        mdp_index.push_back(x.idx);
+        global.push_back(x.global_index());
+      }
+      last[parity] = mdp_index.size();
+    }
+    n_local = mdp_index.size();
+    // everything else is a halo copy
+    for(size_t idx = 0; idx < nvol; idx++)
+      if(soa_index[idx] == -1){
+        soa_index[idx] = mdp_index.size();
+        mdp_index.push_back(idx);
+      }
+    // neighbour table: nbr[dir*n_local + i] with dir = 0..3 the negative
+    // and dir = 4..7 the positive directions
+    nbr.resize(8*n_local);
+    for(size_t i = 0; i < n_local; i++)
+      for(size_t dir = 0; dir < 4; dir++){
+        nbr[dir*n_local + i] = soa_index[x.lattice().dw[mdp_index[i]][dir]];
+        nbr[(dir+4)*n_local + i] = soa_index[x.lattice().up[mdp_index[i]][dir]];
+      }
+    for(auto& c : comp)
+      c.resize(nvol);
+
+    load();
+  };
+
+  // component comp of all sites
+  inline real_t* operator[](const size_t comp) { return this->comp[comp].data(); };
+  inline const real_t* operator[](const size_t comp) const {
+    return this->comp[comp].data();
+  };
+  // neighbour of local site i in direction dir (0..3 down, 4..7 up)
+  inline int neighbour(const size_t dir, const size_t i) const {
+    return nbr[dir*n_local + i];
+  };
+  // all neighbours in direction dir, contiguous in the local site index
+  inline const int* neighbours(const size_t dir) const {
+    return nbr.data() + dir*n_local;
+  };
+
+  inline site_t site(const size_t i) const {
+    return {{comp[0][i], comp[1][i], comp[2][i], comp[3][i]}};
+  };
+  // the field for the update kernels
+  inline FieldView view() {
+    return {{{comp[0].data(), comp[1].data(), comp[2].data(), comp[3].data()}},
+            1, 0};
+  };
+
+  inline size_t begin(const int parity) const { return first[parity]; };
+  inline size_t end(const int parity) const { return last[parity]; };
+  inline size_t local_volume() const { return n_local; };
+  inline size_t nvol() const { return mdp_index.size(); };
+  // translation between the mdp local index and the index used here
+  inline int to_mdp(const size_t i) const { return mdp_index[i]; };
+  inline int from_mdp(const size_t idx) const { return soa_index[idx]; };
+  // global index of local site i, the same for any number of processes
+  inline int global_index(const size_t i) const { return global[i]; };
+  inline const int* global_indices() const { return global.data(); };
+
+  // running sums over the local sites
+  inline const FieldSums& local_sums() const { return sums; };
+  inline void add_to_sums(const FieldSums& change) { sums += change; };
+  // replace them, e.g. by those of another chain (chain_bundle.h)
+  inline void set_local_sums(const FieldSums& local) { sums = local; };
+  // the same summed over all processes
+  inline FieldSums global_sums() const {
+    double s[6] = {sums.phi[0], sums.phi[1], sums.phi[2], sums.phi[3],
+                   sums.phi2, sums.phi4};
+    mdp.add(s, 6);
+    FieldSums global;
+    global.phi = {{s[0], s[1], s[2], s[3]}};
+    global.phi2 = s[4];
+    global.phi4 = s[5];
+    return global;
+  };
+  // |sum_x phi_x|, what compute_magnetisation returns
+  inline double magnetisation() const {
+    const std::array<double, 4> m = global_sums().phi;
+    return sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2] + m[3]*m[3]);
+  };
+  // set the running sums to sums over the whole lattice, e.g. those of a
+  // checkpoint - process 0 takes all of them, so global_sums() returns them
+  // unchanged
+  inline void restore_sums(const FieldSums& global) {
+    sums = (mdp.me() == 0) ? global : FieldSums();
+  };
+  // recompute the running sums from the field
+  inline void resum() {
+    sums = FieldSums();
+    const std::array<double, 4> zero = {{0., 0., 0., 0.}};
+    for(size_t i = 0; i < n_local; i++)
+      sums.add_change(zero, site(i));
+  };
+
+  // copy the mdp field, including the halo, into the arrays
+  inline void load() {
+    for(size_t i = 0; i < mdp_index.size(); i++)
+      for(size_t c = 0; c < 4; c++)
+        comp[c][i] = phi(mdp_index[i])[c];
+    resum();
+  };
+  // write the local sites back into the mdp field
+  inline void store() {
+    for(size_t i = 0; i < n_local; i++)
+      for(size_t c = 0; c < 4; c++)
+        phi(mdp_index[i])[c] = comp[c][i];
+  };
+  // communicate the boundaries after sites of one parity were changed
+  inline void update(const int parity) {
+    if(mdp.nproc() == 1)
+      return;
+    ScopedTimer timer(TIMER_HALO_EXCHANGE);
+    profile().count(COUNTER_HALO_EXCHANGES);
+    for(size_t i = first[parity]; i < last[parity]; i++)
+      for(size_t c = 0; c < 4; c++)
+        phi(mdp_index[i])[c] = comp[c][i];
+    phi.update(parity);
+    for(size_t i = n_local; i < mdp_index.size(); i++)
+      for(size_t c = 0; c < 4; c++)
+        comp[c][i] = phi(mdp_index[i])[c];
+  };
+
+private:
+  mdp_field<site_t>& phi;
+  std::array<std::vector<real_t>, 4> comp;
+  std::vector<int> nbr;
+  std::vector<int> mdp_index, soa_index, global;
+  size_t first[2], last[2], n_local;
+  FieldSums sums;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // PHI_FIELD_H_
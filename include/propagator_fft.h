@@ -0,0 +1,233 @@
+#ifndef PROPAGATOR_FFT_H_
+#define PROPAGATOR_FFT_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <fftw3.h>
+#ifdef PARALLEL
+#include <fftw3-mpi.h>
+#endif
+
+#include "mdp.h"
+#include "instrumentation.h"
+#include "momentum_bins.h"
+#include "phi_field.h"
+
+namespace cluster {
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// FFTW wisdom of the lattice L in outpath, shared by all plans on it
+inline std::string fftw_wisdom_file(const int L[4], const std::string& outpath){
+
+  return outpath + "/fftw_wisdom.T" + std::to_string(L[0]) +
+                   ".X" + std::to_string(L[1]) +
+                   ".Y" + std::to_string(L[2]) +
+                   ".Z" + std::to_string(L[3]);
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// all wisdom of this process, by process 0 to a temporary file which is
+// renamed, jobs sharing outpath never read half a file
+inline void export_fftw_wisdom(const std::string& wisdom_file){
+
+  if(mdp.me() != 0)
+    return;
+  std::string wisdom_tmp = wisdom_file + ".tmp" + std::to_string(getpid());
+  if(!fftw_export_wisdom_to_filename(wisdom_tmp.c_str()) ||
+     rename(wisdom_tmp.c_str(), wisdom_file.c_str()) != 0)
+    printf("Could not write FFTW wisdom to %s\n", wisdom_file.c_str());
+
+}
+
+// Real-to-complex FFT of the Higgs and Goldstone projections and the binning
+// of their propagators. The five projections are written with
+// projections()[5*slot(x) + 0..4] for every local site x, measure() transforms
+// them and returns the binned propagators on all processes.
+//
+// On a single process the slot is the global index, so the projections go
+// straight into the FFT input. With MPI (PARALLEL) the FFT is distributed
+// with FFTW-MPI in slabs of x_0, the direction in which mdp cuts the lattice
+// as well. The projections are then written into a staging buffer in the
+// order of the local sites and sent to the owners of the slabs with one
+// MPI_Alltoallv; where every value ends up is worked out once in the
+// constructor. Every process bins the momenta of its slab and the bins are
+// summed over the processes.
+//
+// FFTW wisdom is kept in outpath, so later jobs on the same geometry skip
+// the FFTW_MEASURE planning.
+class PropagatorFFT {
+
+public:
+  PropagatorFFT(const int L[4], const PhiField& phi,
+                const std::string& outpath) : bins(L), slots(phi.local_volume()),
+                                              mdp_slots(phi.nvol(), -1) {
+
+    const size_t V = size_t(L[0])*L[1]*L[2]*L[3];
+    const std::string wisdom_file = fftw_wisdom_file(L, outpath);
+#ifndef PARALLEL
+    int n[4], onembed[4];
+    for(size_t j = 0; j < 4; j++)
+      n[j] = onembed[j] = L[j];
+    onembed[3] = L[3]/2+1; // complex output of the last dimension
+    if(fftw_import_wisdom_from_filename(wisdom_file.c_str()))
+      mdp << "\tread FFTW wisdom from " << wisdom_file << endl;
+    input = fftw_alloc_real(5*V);
+    output = fftw_alloc_complex(5*bins.half_volume());
+    plan = fftw_plan_many_dft_r2c(4, n, 5, input, n, 5, 1, output, onembed,
+                                  5, 1, FFTW_MEASURE);
+    first_momentum = 0;
+    nb_momenta = bins.half_volume();
+    staging = input;
+    for(size_t x = 0; x < phi.local_volume(); x++)
+      slots[x] = phi.global_index(x);
+#else
+    fftw_mpi_init();
+    if(mdp.me() == 0 && fftw_import_wisdom_from_filename(wisdom_file.c_str()))
+      mdp << "\tread FFTW wisdom from " << wisdom_file << endl;
+    fftw_mpi_broadcast_wisdom(MPI_COMM_WORLD);
+    // slab of x_0 of this process, the r2c sizes are the complex ones
+    const ptrdiff_t nr[4] = {L[0], L[1], L[2], L[3]};
+    const ptrdiff_t nc[4] = {L[0], L[1], L[2], L[3]/2+1};
+    ptrdiff_t local_n0, local_0_start;
+    const ptrdiff_t alloc = fftw_mpi_local_size_many(4, nc, 5,
+                                FFTW_MPI_DEFAULT_BLOCK, MPI_COMM_WORLD,
+                                &local_n0, &local_0_start);
+    input = fftw_alloc_real(2*alloc);
+    output = fftw_alloc_complex(alloc);
+    plan = fftw_mpi_plan_many_dft_r2c(4, nr, 5, FFTW_MPI_DEFAULT_BLOCK,
+                                      FFTW_MPI_DEFAULT_BLOCK, input, output,
+                                      MPI_COMM_WORLD, FFTW_MEASURE);
+    fftw_mpi_gather_wisdom(MPI_COMM_WORLD);
+    const size_t slab = size_t(L[1])*L[2]*(L[3]/2+1); // momenta per n_0
+    first_momentum = local_0_start*slab;
+    nb_momenta = local_n0*slab;
+
+    // owner of every x_0 slab
+    const int nproc = mdp.nproc();
+    long mine[2] = {long(local_0_start), long(local_n0)};
+    std::vector<long> all(2*nproc);
+    MPI_Allgather(mine, 2, MPI_LONG, all.data(), 2, MPI_LONG, MPI_COMM_WORLD);
+    std::vector<int> owner(L[0]);
+    for(int p = 0; p < nproc; p++)
+      for(long x0 = all[2*p]; x0 < all[2*p] + all[2*p+1]; x0++)
+        owner[x0] = p;
+    // local sites sorted by the process they are sent to, together with
+    // their position in the padded FFT input of that process
+    std::vector<int> count(nproc, 0);
+    for(size_t x = 0; x < phi.local_volume(); x++)
+      count[owner[phi.global_index(x)/(V/L[0])]]++;
+    send_count.assign(nproc, 0);
+    send_displ.assign(nproc, 0);
+    for(int p = 1; p < nproc; p++)
+      send_displ[p] = send_displ[p-1] + count[p-1];
+    send_order.resize(phi.local_volume());
+    std::vector<int> send_pos(phi.local_volume());
+    for(size_t x = 0; x < phi.local_volume(); x++){
+      int g = phi.global_index(x);
+      const int x3 = g % L[3]; g /= L[3];
+      const int x2 = g % L[2]; g /= L[2];
+      const int x1 = g % L[1];
+      const int x0 = g / L[1];
+      const int p = owner[x0];
+      const int i = send_displ[p] + send_count[p]++;
+      send_order[i] = x;
+      send_pos[i] = (((x0 - all[2*p])*L[1] + x1)*L[2] + x2)*(2*(L[3]/2+1)) + x3;
+    }
+    recv_count.resize(nproc);
+    MPI_Alltoall(send_count.data(), 1, MPI_INT, recv_count.data(), 1, MPI_INT,
+                 MPI_COMM_WORLD);
+    recv_displ.assign(nproc, 0);
+    for(int p = 1; p < nproc; p++)
+      recv_displ[p] = recv_displ[p-1] + recv_count[p-1];
+    recv_pos.resize(recv_displ[nproc-1] + recv_count[nproc-1]);
+    MPI_Alltoallv(send_pos.data(), send_count.data(), send_displ.data(),
+                  MPI_INT, recv_pos.data(), recv_count.data(),
+                  recv_displ.data(), MPI_INT, MPI_COMM_WORLD);
+    // from now on everything moves in units of 5 doubles
+    for(int p = 0; p < nproc; p++){
+      send_count[p] *= 5; send_displ[p] *= 5;
+      recv_count[p] *= 5; recv_displ[p] *= 5;
+    }
+    send_buffer.resize(5*send_order.size());
+    recv_buffer.resize(5*recv_pos.size());
+    local_input.resize(5*phi.local_volume());
+    staging = local_input.data();
+    for(size_t x = 0; x < phi.local_volume(); x++)
+      slots[x] = x;
+#endif
+    for(size_t x = 0; x < phi.local_volume(); x++)
+      mdp_slots[phi.to_mdp(x)] = slots[x];
+
+    export_fftw_wisdom(wisdom_file);
+  };
+  ~PropagatorFFT() {
+    fftw_destroy_plan(plan);
+    fftw_free(input);
+    fftw_free(output);
+  };
+  PropagatorFFT(const PropagatorFFT&) = delete;
+  PropagatorFFT& operator=(const PropagatorFFT&) = delete;
+
+  // where the projections are written to
+  inline double* projections() { return staging; };
+  // slot of the local soa site x, or of the local mdp site idx
+  inline int slot(const size_t x) const { return slots[x]; };
+  inline int slot_of_mdp(const size_t idx) const { return mdp_slots[idx]; };
+  inline const MomentumBins& momentum_bins() const { return bins; };
+
+  // transforms the projections, higgs[b] and goldstone[b] receive the
+  // propagators averaged over the momenta in bin b on every process
+  inline void measure(std::vector<double>& higgs,
+                      std::vector<double>& goldstone) {
+
+    const wall_clock::time_point begin = wall_clock::now();
+#ifdef PARALLEL
+    // local sites to the owners of their slabs
+    for(size_t i = 0; i < send_order.size(); i++)
+      for(size_t c = 0; c < 5; c++)
+        send_buffer[5*i+c] = staging[5*send_order[i]+c];
+    MPI_Alltoallv(send_buffer.data(), send_count.data(), send_displ.data(),
+                  MPI_DOUBLE, recv_buffer.data(), recv_count.data(),
+                  recv_displ.data(), MPI_DOUBLE, MPI_COMM_WORLD);
+    for(size_t i = 0; i < recv_pos.size(); i++)
+      for(size_t c = 0; c < 5; c++)
+        input[5*size_t(recv_pos[i])+c] = recv_buffer[5*i+c];
+#endif
+    fftw_execute(plan);
+    profile().add_time(TIMER_FFT, wall_clock::now() - begin);
+
+    higgs.assign(bins.size(), 0.0);
+    goldstone.assign(bins.size(), 0.0);
+    bins.add(output, first_momentum, nb_momenta, higgs, goldstone);
+    if(mdp.nproc() > 1){ // every process holds one slab of momenta
+      mdp.add(higgs.data(), higgs.size());
+      mdp.add(goldstone.data(), goldstone.size());
+    }
+    bins.normalise(higgs, goldstone);
+  };
+
+private:
+  const MomentumBins bins;
+  double* input;
+  fftw_complex* output;
+  fftw_plan plan;
+  size_t first_momentum, nb_momenta;
+  double* staging;
+  std::vector<int> slots, mdp_slots;
+#ifdef PARALLEL
+  std::vector<double> local_input, send_buffer, recv_buffer;
+  std::vector<int> send_order, recv_pos;
+  std::vector<int> send_count, send_displ, recv_count, recv_displ;
+#endif
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // PROPAGATOR_FFT_H_
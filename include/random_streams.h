@@ -0,0 +1,218 @@
+#ifndef RANDOM_STREAMS_H_
+#define RANDOM_STREAMS_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "mdp.h"
+
+namespace cluster {
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al., SC11). Every
+// number is a pure function of (seed, replica) as key and (site, step, block)
+// as counter, so there is no shared state between sites: a site draws the
+// same numbers no matter which thread, SIMD lane or process updates it and in
+// which order. "step" counts the calls of the update functions, "block" the
+// pairs of doubles drawn inside one (site, step) stream.
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline void philox4x32(uint32_t ctr[4], uint32_t k0, uint32_t k1){
+
+  for(int round = 0; round < 10; round++){
+    const uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+    const uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+    const uint32_t c1 = ctr[1], c3 = ctr[3];
+    ctr[0] = uint32_t(p1 >> 32) ^ c1 ^ k0;
+    ctr[1] = uint32_t(p1);
+    ctr[2] = uint32_t(p0 >> 32) ^ c3 ^ k1;
+    ctr[3] = uint32_t(p0);
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// two doubles in [0, 1) with 53 random bits each from one Philox block
+inline void philox_uniform(const uint32_t k0, const uint32_t k1,
+                           const uint32_t site, const uint64_t step,
+                           const uint32_t block, double& u0, double& u1){
+
+  uint32_t ctr[4] = {site, uint32_t(step), uint32_t(step >> 32), block};
+  philox4x32(ctr, k0, k1);
+  u0 = ((uint64_t(ctr[0]) << 32 | ctr[1]) >> 11) * (1./9007199254740992.);
+  u1 = ((uint64_t(ctr[2]) << 32 | ctr[3]) >> 11) * (1./9007199254740992.);
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the first n numbers of W streams at once, lane l with key (k0[l], k1[l])
+// and counter (site[l], step[l], block), interleaved as out[k*W + lane] - the
+// lanes run through Philox side by side, which vectorises the integer
+// multiplications
+template<size_t W>
+inline void philox_fill_lanes(const uint32_t* k0, const uint32_t* k1,
+                              const uint32_t* site, const uint64_t* step,
+                              double* out, const size_t n){
+
+  for(size_t block = 0; 2*block < n; block++){
+    uint32_t c0[W], c1[W], c2[W], c3[W], key0[W], key1[W];
+    for(size_t lane = 0; lane < W; lane++){
+      c0[lane] = site[lane];
+      c1[lane] = uint32_t(step[lane]);
+      c2[lane] = uint32_t(step[lane] >> 32);
+      c3[lane] = block;
+      key0[lane] = k0[lane];
+      key1[lane] = k1[lane];
+    }
+    for(int round = 0; round < 10; round++){
+      for(size_t lane = 0; lane < W; lane++){
+        const uint64_t p0 = uint64_t(0xD2511F53) * c0[lane];
+        const uint64_t p1 = uint64_t(0xCD9E8D57) * c2[lane];
+        const uint32_t d1 = c1[lane], d3 = c3[lane];
+        c0[lane] = uint32_t(p1 >> 32) ^ d1 ^ key0[lane];
+        c1[lane] = uint32_t(p1);
+        c2[lane] = uint32_t(p0 >> 32) ^ d3 ^ key1[lane];
+        c3[lane] = uint32_t(p0);
+        key0[lane] += 0x9E3779B9;
+        key1[lane] += 0xBB67AE85;
+      }
+    }
+    for(size_t lane = 0; lane < W; lane++){
+      out[2*block*W + lane] =
+        ((uint64_t(c0[lane]) << 32 | c1[lane]) >> 11) * (1./9007199254740992.);
+      if(2*block + 1 < n)
+        out[(2*block+1)*W + lane] =
+        ((uint64_t(c2[lane]) << 32 | c3[lane]) >> 11) * (1./9007199254740992.);
+    }
+  }
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// the stream of one site in one step, used like mdp_random_generator
+class RandomStream {
+
+public:
+  RandomStream(const uint32_t k0, const uint32_t k1, const uint32_t site,
+               const uint64_t step) : k0(k0), k1(k1), site(site), step(step),
+                                      block(0), next(2) {};
+
+  inline double plain() {
+    if(next == 2){
+      philox_uniform(k0, k1, site, step, block++, u[0], u[1]);
+      next = 0;
+    }
+    return u[next++];
+  };
+
+private:
+  uint32_t k0, k1, site;
+  uint64_t step;
+  uint32_t block, next;
+  double u[2];
+
+}; // end of class definition
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+class RandomStreams {
+
+public:
+  RandomStreams(const int seed, const int replica) :
+                            seed(seed), replica(replica), current_step(0) {};
+
+  // every call of an update function starts a new step
+  inline uint64_t next_step() { return current_step++; };
+  inline uint64_t step() const { return current_step; };
+
+  inline RandomStream stream(const uint64_t step, const uint32_t site) const {
+    return RandomStream(seed, replica, site, step);
+  };
+  // streams which are not tied to a site live above all site indices: one
+  // shared by all processes for global choices, e.g. the cluster reflection
+  // plane, and one per process for serial work like the cluster growth
+  inline RandomStream global_stream(const uint64_t step) const {
+    return stream(step, uint32_t(-1));
+  };
+  inline RandomStream process_stream(const uint64_t step) const {
+    return stream(step, uint32_t(-2) - mdp.me());
+  };
+
+  // the first n numbers of stream(step, site), written to out[0],
+  // out[stride], ... - a plain loop over independent blocks which the
+  // compiler is free to vectorise
+  inline void fill(const uint64_t step, const uint32_t site, double* out,
+                   const size_t n, const size_t stride = 1) const {
+    for(size_t i = 0; i + 1 < n; i += 2)
+      philox_uniform(seed, replica, site, step, i/2, out[i*stride],
+                     out[(i+1)*stride]);
+    if(n % 2){
+      double dummy;
+      philox_uniform(seed, replica, site, step, n/2, out[(n-1)*stride], dummy);
+    }
+  };
+
+  // the first n numbers of the streams of W sites at once, interleaved as
+  // out[k*W + lane]
+  template<size_t W>
+  inline void fill_lanes(const uint64_t step, const int* sites, double* out,
+                         const size_t n) const {
+    uint32_t k0[W], k1[W], site[W];
+    uint64_t steps[W];
+    for(size_t lane = 0; lane < W; lane++){
+      k0[lane] = seed;
+      k1[lane] = replica;
+      site[lane] = sites[lane];
+      steps[lane] = step;
+    }
+    philox_fill_lanes<W>(k0, k1, site, steps, out, n);
+  }
+
+  // the key of all streams
+  inline uint32_t key0() const { return seed; };
+  inline uint32_t key1() const { return replica; };
+
+  // the whole state are three numbers, it replaces the state files of the
+  // mdp_random_generator
+  inline std::string state() const {
+    return "philox4x32 " + std::to_string(seed) + " " +
+           std::to_string(replica) + " " + std::to_string(current_step) + "\n";
+  };
+  inline bool set_state(const std::string& state) {
+    unsigned long long s = 0;
+    if(sscanf(state.c_str(), "philox4x32 %u %u %llu\n", &seed, &replica,
+              &s) != 3)
+      return false;
+    current_step = s;
+    return true;
+  };
+  inline void write_state(const std::string& filename) const {
+    FILE* f = fopen(filename.c_str(), "w");
+    if(f == NULL){
+      std::cerr << "Could not write random state to " << filename << endl;
+      return;
+    }
+    fputs(state().c_str(), f);
+    fclose(f);
+  };
+  inline void read_state(const std::string& filename) {
+    char line[256] = {0};
+    FILE* f = fopen(filename.c_str(), "r");
+    if(f == NULL || fgets(line, sizeof(line), f) == NULL || !set_state(line)){
+      std::cerr << "Could not read random state from " << filename << endl;
+      std::cerr << "Aborting..." << endl;
+      exit(-10);
+    }
+    fclose(f);
+  };
+
+private:
+  uint32_t seed, replica;
+  uint64_t current_step;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // RANDOM_STREAMS_H_
@@ -0,0 +1,197 @@
+#ifndef REPLICA_EXCHANGE_H_
+#define REPLICA_EXCHANGE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "mdp.h"
+#include "chain_bundle.h"
+#include "random_streams.h"
+
+namespace cluster {
+
+// Parallel tempering on the chains of a ChainBundle. The couplings form a
+// ladder of slots, slot s has kappa[s] and lambda[s]; chain k of the bundle
+// is a walker which sits in one slot at a time. A swap of two neighbouring
+// slots exchanges the slots of their walkers - the fields stay where they
+// are, only the couplings of the two lanes are exchanged. Every walker keeps
+// its own random streams, every slot its own observables.
+//
+// Swaps are proposed every swap_every iterations, for the pairs (s, s+1)
+// with s even and s odd in turn, and accepted with min(1, exp(-dS)), with
+//
+//   dS = 2(kappa_s - kappa_s+1)(H_a - H_b) + (lambda_s - lambda_s+1)(U_b - U_a)
+//
+// for walker a in slot s and b in slot s+1, H = sum_x sum_mu phi_x.phi_x+mu
+// the hopping term and U = sum_x (phi_x^2 - 1)^2 the potential. The random
+// numbers of the swaps come from their own key (seed, ~replica), counter
+// (pair, iteration), so a restarted run makes the same decisions.
+//
+// Statistics: the acceptance rate of every pair and the round trips of the
+// walkers from slot 0 to the last slot and back, in iterations.
+class ReplicaExchange {
+
+public:
+  ReplicaExchange(const std::vector<double>& kappa,
+                  const std::vector<double>& lambda, const int seed,
+                  const int replica, const int swap_every) :
+                         slot_kappa(kappa), slot_lambda(lambda),
+                         lane_kappa(kappa), lane_lambda(lambda),
+                         swaps(seed, ~uint32_t(replica)),
+                         swap_every(swap_every), proposed(kappa.size(), 0),
+                         accepted(kappa.size(), 0),
+                         direction(kappa.size(), NONE),
+                         start(kappa.size(), 0), round_trips(0),
+                         round_trip_time(0.) {
+    for(size_t k = 0; k < kappa.size(); k++){
+      slots.push_back(k);
+      walkers.push_back(k);
+    }
+    arrive(0);
+  };
+
+  inline size_t size() const { return slots.size(); };
+  // the slot of chain k and the chain in slot s
+  inline size_t slot(const size_t k) const { return slots[k]; };
+  inline size_t walker(const size_t s) const { return walkers[s]; };
+  // the couplings of every chain in its current slot, for the lockstep sweep
+  inline const std::vector<double>& kappa() const { return lane_kappa; };
+  inline const std::vector<double>& lambda() const { return lane_lambda; };
+
+  // propose swaps of neighbouring slots if it is time to, every other pair
+  // in turn
+  inline void swap(const ChainBundle& chains, const int64_t iteration) {
+
+    if(swap_every <= 0 || iteration%swap_every != 0)
+      return;
+    std::vector<double> hopping, potential;
+    measure(chains, hopping, potential);
+    for(size_t s = (iteration/swap_every)%2; s + 1 < size(); s += 2){
+      const size_t a = walkers[s], b = walkers[s+1];
+      const double dS =
+        2.*(slot_kappa[s] - slot_kappa[s+1])*(hopping[a] - hopping[b]) +
+        (slot_lambda[s] - slot_lambda[s+1])*(potential[b] - potential[a]);
+      RandomStream random = swaps.stream(iteration, s);
+      proposed[s]++;
+      if(random.plain() < exp(-dS)){
+        accepted[s]++;
+        std::swap(walkers[s], walkers[s+1]);
+        slots[a] = s+1;
+        slots[b] = s;
+        lane_kappa[a] = slot_kappa[s+1];
+        lane_lambda[a] = slot_lambda[s+1];
+        lane_kappa[b] = slot_kappa[s];
+        lane_lambda[b] = slot_lambda[s];
+      }
+    }
+    arrive(iteration);
+  };
+
+  // acceptance of the swaps between slot s and s+1
+  inline double acceptance(const size_t s) const {
+    return proposed[s] > 0 ? double(accepted[s])/proposed[s] : 0.;
+  };
+  // completed round trips and their mean length in iterations
+  inline size_t nb_round_trips() const { return round_trips; };
+  inline double mean_round_trip() const {
+    return round_trips > 0 ? round_trip_time/round_trips : 0.;
+  };
+
+  // a table of the statistics, written by process 0
+  inline void write_statistics(const std::string& filename) const {
+    if(mdp.me() != 0)
+      return;
+    FILE* f = fopen(filename.c_str(), "w");
+    if(f == NULL){
+      std::cerr << "Could not write " << filename << endl;
+      return;
+    }
+    fprintf(f, "# slot kappa lambda kappa_next lambda_next proposed accepted "
+               "acceptance\n");
+    for(size_t s = 0; s + 1 < size(); s++)
+      fprintf(f, "%zu %.8f %.8f %.8f %.8f %llu %llu %.6f\n", s, slot_kappa[s],
+              slot_lambda[s], slot_kappa[s+1], slot_lambda[s+1],
+              (unsigned long long) proposed[s],
+              (unsigned long long) accepted[s], acceptance(s));
+    fprintf(f, "# round trips %zu mean length %.2f iterations\n", round_trips,
+            mean_round_trip());
+    fclose(f);
+  };
+
+private:
+  typedef enum direction_t { NONE=0, UP, DOWN } direction_t;
+
+  // hopping term and potential of every chain over the whole lattice, summed
+  // in fixed blocks so the result does not depend on the number of threads
+  inline void measure(const ChainBundle& chains, std::vector<double>& hopping,
+                      std::vector<double>& potential) const {
+    const size_t K = chains.size();
+    const PhiField& phi = chains.geometry();
+    const size_t n = phi.local_volume();
+    const size_t nb_blocks = (n + sums_block - 1)/sums_block;
+    std::vector<double> partial(2*K*nb_blocks, 0.);
+    #pragma omp parallel for schedule(static)
+    for(size_t block = 0; block < nb_blocks; block++){
+      double* const h = partial.data() + 2*K*block;
+      double* const u = h + K;
+      for(size_t x = block*sums_block; x < std::min((block+1)*sums_block, n);
+          x++)
+        for(size_t k = 0; k < K; k++){
+          double phiSqr = 0., link = 0.;
+          for(size_t c = 0; c < 4; c++){
+            const real_t* const comp = chains[c];
+            const double p = comp[x*K + k];
+            double up = 0.;
+            for(size_t dir = 4; dir < 8; dir++)
+              up += comp[phi.neighbour(dir, x)*K + k];
+            phiSqr += p*p;
+            link += p*up;
+          }
+          h[k] += link;
+          u[k] += (phiSqr - 1.)*(phiSqr - 1.);
+        }
+    }
+    std::vector<double> sums(2*K, 0.);
+    for(size_t block = 0; block < nb_blocks; block++)
+      for(size_t i = 0; i < 2*K; i++)
+        sums[i] += partial[2*K*block + i];
+    mdp.add(sums.data(), 2*K);
+    hopping.assign(sums.begin(), sums.begin() + K);
+    potential.assign(sums.begin() + K, sums.end());
+  };
+  // round trips: a walker starts one in slot 0, turns in the last slot and
+  // completes it back in slot 0
+  inline void arrive(const int64_t iteration) {
+    const size_t bottom = walkers[0], top = walkers[size()-1];
+    if(direction[bottom] == DOWN){
+      round_trips++;
+      round_trip_time += iteration - start[bottom];
+    }
+    if(direction[bottom] != UP){
+      direction[bottom] = UP;
+      start[bottom] = iteration;
+    }
+    if(direction[top] == UP)
+      direction[top] = DOWN;
+  };
+
+  const std::vector<double> slot_kappa, slot_lambda;
+  std::vector<double> lane_kappa, lane_lambda;
+  std::vector<size_t> slots, walkers;
+  RandomStreams swaps;
+  const int swap_every;
+  std::vector<uint64_t> proposed, accepted;
+  std::vector<direction_t> direction;
+  std::vector<int64_t> start;
+  size_t round_trips;
+  double round_trip_time;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // REPLICA_EXCHANGE_H_
@@ -0,0 +1,226 @@
+#ifndef SWENDSEN_WANG_H_
+#define SWENDSEN_WANG_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "instrumentation.h"
+#include "phi_field.h"
+#include "random_streams.h"
+
+namespace cluster {
+
+// Swendsen-Wang multi-cluster update of the embedded Ising variables
+// s_x = phi_x.r for a random unit vector r. Every bond <x,y> with
+// s_x*s_y > 0 is activated with probability 1 - exp(-4 kappa s_x s_y), the
+// connected components of the active bonds are labelled and every component
+// is reflected, phi -> phi - 2 (phi.r) r, with probability 1/2.
+//
+// Bond activation and labelling run as one parallel pass over the sites: the
+// bonds are merged into a concurrent union-find forest (lock-free linking by
+// compare-and-swap, path halving in find). Roots are always linked below the
+// smaller index, so the forest does not depend on the number of threads.
+//
+// With several processes every process first labels its local clusters. The
+// bond x -> x+mu is decided by the owner of x from the stream of x, and the
+// active bonds are exchanged through the halo, so both sides of a process
+// boundary know which bonds cross it. The labels are then merged across the
+// boundaries by exchanging them through the halo and keeping the smallest
+// one until no process changes anymore. A cluster is finally labelled by its
+// smallest global site index and flips with the stream of that site, which
+// makes the update independent of the number of processes and threads.
+class SwendsenWang {
+
+public:
+  SwendsenWang(const PhiField& phi, mdp_site& x) :
+                                    nvol(phi.local_volume()),
+                                    parent(new std::atomic<int>[nvol]),
+                                    label(new std::atomic<int>[nvol]),
+                                    bonds(nvol), flip(nvol),
+                                    change((nvol + sums_block - 1)/sums_block),
+                                    halo_field(x.lattice()) {};
+
+  // returns the number of flipped sites
+  inline double update(PhiField& phi, RandomStreams& streams,
+                       const double kappa) {
+
+    const uint64_t step_bonds = streams.next_step();
+    const uint64_t step_flips = streams.next_step();
+    const wall_clock::time_point growth_begin = wall_clock::now();
+
+    // vector which defines rotation plane, the same on all processes --------
+    RandomStream random = streams.global_stream(step_bonds);
+    std::array<double, 4> r =
+                           {{random.plain()*2.-1., random.plain()*2.-1.,
+                             random.plain()*2.-1., random.plain()*2.-1.}};
+    double len = sqrt(r[0]*r[0] + r[1]*r[1] + r[2]*r[2] + r[3]*r[3]);
+    r[0]/=len; r[1]/=len; r[2]/=len; r[3]/=len; // normalisation
+
+    #pragma omp parallel
+    {
+      // every site starts as its own cluster
+      #pragma omp for schedule(static)
+      for(size_t x = 0; x < nvol; x++){
+        parent[x].store(x, std::memory_order_relaxed);
+        label[x].store(INT_MAX, std::memory_order_relaxed);
+      }
+      // bond activation in positive directions, merging on the fly ----------
+      #pragma omp for schedule(static)
+      for(size_t x = 0; x < nvol; x++){
+        RandomStream random = streams.stream(step_bonds, phi.global_index(x));
+        const double scalar_x = 4.*kappa * (phi[0][x]*r[0] + phi[1][x]*r[1] +
+                                            phi[2][x]*r[2] + phi[3][x]*r[3]);
+        bonds[x] = 0;
+        for(size_t dir = 0; dir < 4; dir++){
+          const size_t y = phi.neighbour(dir+4, x);
+          const double dS = -scalar_x * (phi[0][y]*r[0] + phi[1][y]*r[1] +
+                                         phi[2][y]*r[2] + phi[3][y]*r[3]);
+          if((dS < 0.0) && (1.-exp(dS)) > random.plain()){
+            bonds[x] |= 1 << dir;
+            if(y < nvol) // halo copies are merged below
+              unite(x, y);
+          }
+        }
+      }
+      // the smallest global site of every local cluster ----------------------
+      #pragma omp for schedule(static)
+      for(size_t x = 0; x < nvol; x++){
+        std::atomic<int>& l = label[find(x)];
+        const int g = phi.global_index(x);
+        int current = l.load(std::memory_order_relaxed);
+        while(g < current && !l.compare_exchange_weak(current, g));
+      }
+    }
+    if(mdp.nproc() > 1)
+      merge_across_processes(phi);
+    const wall_clock::time_point flip_begin = wall_clock::now();
+    profile().add_time(TIMER_CLUSTER_GROWTH, flip_begin - growth_begin);
+
+    size_t flipped = 0, clusters = 0;
+    #pragma omp parallel
+    {
+      // every cluster decides with the stream of its smallest site ----------
+      #pragma omp for schedule(static) reduction(+:clusters)
+      for(size_t x = 0; x < nvol; x++)
+        if(find(x) == int(x)){
+          flip[x] = streams.stream(step_flips, label[x]).plain() < .5;
+          clusters++;
+        }
+      // perform the phi flip, block by block for the field sums -------------
+      #pragma omp for schedule(static) reduction(+:flipped)
+      for(size_t block = 0; block < change.size(); block++){
+        change[block] = FieldSums();
+        const size_t block_end = std::min((block+1)*sums_block, nvol);
+        for(size_t x = block*sums_block; x < block_end; x++)
+          if(flip[find(x)]){
+            const PhiField::site_t before = phi.site(x);
+            double scalar = -2.*(phi[0][x]*r[0] + phi[1][x]*r[1] +
+                                 phi[2][x]*r[2] + phi[3][x]*r[3]);
+            for(int dir = 0; dir < 4; dir++)
+              phi[dir][x] += scalar*r[dir];
+            change[block].add_change(before, phi.site(x));
+            flipped++;
+          }
+      }
+    }
+    for(const auto& c : change)
+      phi.add_to_sums(c);
+    profile().add_time(TIMER_CLUSTER_FLIP, wall_clock::now() - flip_begin);
+    // clusters across processes count once on every process they touch
+    profile().count(COUNTER_CLUSTER_UPDATES);
+    profile().count(COUNTER_CLUSTERS, clusters);
+    profile().count(COUNTER_FLIPPED_SITES, flipped);
+    phi.update(EVEN); // communicate boundaries
+    phi.update(ODD);
+
+    return flipped;
+  };
+
+private:
+  // root of x with path halving, safe against concurrent unite()
+  inline int find(int x) {
+    int p = parent[x].load(std::memory_order_relaxed);
+    while(p != x){
+      const int gp = parent[p].load(std::memory_order_relaxed);
+      if(gp != p) // the grandparent is also an ancestor, so this is safe
+        parent[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+      x = p;
+      p = parent[x].load(std::memory_order_relaxed);
+    }
+    return x;
+  };
+  // merge the clusters of a and b, the larger root goes below the smaller
+  inline void unite(int a, int b) {
+    while(true){
+      a = find(a);
+      b = find(b);
+      if(a == b)
+        return;
+      if(a < b)
+        std::swap(a, b);
+      int expected = a;
+      if(parent[a].compare_exchange_strong(expected, b))
+        return;
+    }
+  };
+  // copy a value per local site into the halo of the neighbouring processes
+  inline void exchange(const PhiField& phi, const std::vector<int>& local,
+                       std::vector<int>& halo) {
+    for(size_t x = 0; x < nvol; x++)
+      halo_field(phi.to_mdp(x)) = local[x];
+    halo_field.update();
+    halo.resize(phi.nvol() - nvol);
+    for(size_t h = nvol; h < phi.nvol(); h++)
+      halo[h - nvol] = halo_field(phi.to_mdp(h));
+  };
+  // distributed union-find on the cluster labels: propagate the smallest
+  // label over the active bonds which cross a process boundary
+  inline void merge_across_processes(const PhiField& phi) {
+
+    // the halo learns which bonds its owner activated
+    std::vector<int> local(bonds.begin(), bonds.end()), halo;
+    exchange(phi, local, halo);
+    // (local root, halo site) for every active bond across the boundary
+    std::vector<std::pair<int, int> > links;
+    for(size_t x = 0; x < nvol; x++)
+      for(size_t dir = 0; dir < 4; dir++){
+        const size_t y = phi.neighbour(dir+4, x); // decided here
+        if(y >= nvol && (bonds[x] >> dir & 1))
+          links.emplace_back(find(x), y - nvol);
+        const size_t z = phi.neighbour(dir, x); // decided by the owner of z
+        if(z >= nvol && (halo[z - nvol] >> dir & 1))
+          links.emplace_back(find(x), z - nvol);
+      }
+
+    double changed = 1.;
+    while(changed > 0.){
+      for(size_t x = 0; x < nvol; x++)
+        local[x] = label[find(x)];
+      exchange(phi, local, halo);
+      changed = 0.;
+      for(const auto& link : links)
+        if(halo[link.second] < label[link.first]){
+          label[link.first] = halo[link.second];
+          changed = 1.;
+        }
+      mdp.add(changed); // until no process lowers a label anymore
+    }
+  };
+
+  const size_t nvol;
+  std::unique_ptr<std::atomic<int>[]> parent, label;
+  std::vector<char> bonds, flip;
+  std::vector<FieldSums> change;
+  mdp_field<int> halo_field;
+
+}; // end of class definition
+
+} // end of namespace
+
+#endif // SWENDSEN_WANG_H_
@@ -0,0 +1,283 @@
+#ifndef UPDATES_H_
+#define UPDATES_H_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cluster_workspace.h"
+#include "instrumentation.h"
+#include "phi_field.h"
+#include "random_streams.h"
+
+namespace cluster {
+
+// Metropolis and cluster update on the structure-of-arrays field. They do
+// what the mdp_field versions in the drivers do, but every site draws its
+// random numbers from its own counter-based stream (site, step), so the
+// result does not depend on the order in which the sites are visited. All of
+// them keep the running field sums of PhiField up to date.
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// number of threads for the site loops, 0 keeps the OpenMP default
+inline int init_threads(const int threads){
+
+#ifdef _OPENMP
+  if(threads > 0)
+    omp_set_num_threads(threads);
+  return omp_get_max_threads();
+#else
+  if(threads > 1)
+    mdp << "Compiled without OpenMP, running with a single thread" << endl;
+  return 1;
+#endif
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// multihit Metropolis on the single local site x of the field f, which has
+// the geometry of phi, returns the number of accepted hits and adds the
+// change of the field sums to change
+inline double metropolis_site(const PhiField& phi, const FieldView& f,
+                              const size_t x, RandomStream& random,
+                              const double kappa, const double lambda,
+                              const double delta, const size_t nb_of_hits,
+                              FieldSums& change){
+
+  double acc = .0;
+  const size_t i = f.index(x);
+  const PhiField::site_t before = f.site(x);
+  // computing phi^2 on x
+  auto phiSqr = before[0]*before[0] + before[1]*before[1] +
+                before[2]*before[2] + before[3]*before[3];
+  // running over the four components, comp, of the phi field - Each
+  // component is updated individually with multiple hits
+  for(size_t comp = 0; comp < 4; comp++){
+    real_t* const phi_comp = f.comp[comp];
+    double Phi = phi_comp[i]; // in double, rounded when it is stored
+    // compute the neighbour sum
+    auto neighbourSum = 0.0;
+    for(size_t dir = 0; dir < 4; dir++) // dir = direction
+      neighbourSum += phi_comp[f.index(phi.neighbour(dir, x))] +
+                      phi_comp[f.index(phi.neighbour(dir+4, x))];
+    // doing the multihit
+    for(size_t hit = 0; hit < nb_of_hits; hit++){
+      auto deltaPhi = (random.plain()*2. - 1.)*delta;
+      auto deltaPhiPhi = deltaPhi * Phi;
+      auto deltaPhideltaPhi = deltaPhi * deltaPhi;
+      // change of action
+      auto dS = -2.*kappa*deltaPhi*neighbourSum +
+                 2.*deltaPhiPhi*(1. - 2.*lambda*(1. - phiSqr - deltaPhideltaPhi)) +
+                 deltaPhideltaPhi*(1. - 2.*lambda*(1. - phiSqr)) +
+                 lambda*(4.*deltaPhiPhi*deltaPhiPhi + deltaPhideltaPhi*deltaPhideltaPhi);
+      // Monate Carlo accept reject step ---------------------------------------
+      if(random.plain() < exp(-dS)) {
+        phiSqr -= Phi*Phi;
+        Phi = real_t(Phi + deltaPhi); // the value which is stored
+        phiSqr += Phi*Phi;
+        acc++;
+      }
+    } // multi hit ends here
+    phi_comp[i] = Phi;
+  } // loop over components ends here
+  change.add_change(before, f.site(x));
+
+  return acc;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline double metropolis_site(PhiField& phi, const size_t x,
+                              RandomStream& random,
+                              const double kappa, const double lambda,
+                              const double delta, const size_t nb_of_hits,
+                              FieldSums& change){
+
+  return metropolis_site(phi, phi.view(), x, random, kappa, lambda, delta,
+                         nb_of_hits, change);
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// site_update on the local sites [x_begin, x_end), which must all have the
+// same parity, returns the sum of what it returns
+template<class F>
+inline double update_sites(PhiField& phi, const size_t x_begin,
+                           const size_t x_end, const RandomStreams& streams,
+                           const uint64_t step, F site_update){
+
+  double sum = .0;
+  const size_t nb_blocks = (x_end - x_begin + sums_block - 1)/sums_block;
+  std::vector<FieldSums> change(nb_blocks);
+  // sites of one parity are independent and every site has its own stream
+  #pragma omp parallel for reduction(+:sum) schedule(static)
+  for(size_t block = 0; block < nb_blocks; block++) {
+    const size_t block_end = std::min(x_begin + (block+1)*sums_block, x_end);
+    for(size_t x = x_begin + block*sums_block; x < block_end; x++) {
+      RandomStream random = streams.stream(step, phi.global_index(x));
+      sum += site_update(x, random, change[block]);
+    }
+  }
+  for(const auto& c : change)
+    phi.add_to_sums(c);
+  return sum;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// multihit Metropolis on the local sites [x_begin, x_end), which must all
+// have the same parity, returns the number of accepted hits
+inline double metropolis_sites(PhiField& phi, const size_t x_begin,
+                               const size_t x_end,
+                               const RandomStreams& streams, const uint64_t step,
+                               const double kappa, const double lambda,
+                               const double delta, const size_t nb_of_hits){
+
+  return update_sites(phi, x_begin, x_end, streams, step,
+                      [&](const size_t x, RandomStream& random,
+                          FieldSums& change){
+    return metropolis_site(phi, x, random, kappa, lambda, delta, nb_of_hits,
+                           change);
+  });
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline double metropolis_update(PhiField& phi, RandomStreams& streams,
+                                const double kappa, const double lambda,
+                                const double delta, const size_t nb_of_hits){
+
+  const uint64_t step = streams.next_step();
+  double acc = .0;
+  profile().count(COUNTER_METROPOLIS_SWEEPS);
+  for(int parity=EVEN; parity<=ODD; parity++) {
+    {
+      ScopedTimer timer(parity == EVEN ? TIMER_METROPOLIS_EVEN :
+                                         TIMER_METROPOLIS_ODD);
+      acc += metropolis_sites(phi, phi.begin(parity), phi.end(parity), streams,
+                              step, kappa, lambda, delta, nb_of_hits);
+    }
+    phi.update(parity); // communicate boundaries
+  }
+
+  return acc/(4*nb_of_hits); // the 4 accounts for updating the component indiv.
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline void check_neighbour(const size_t y, const double scalar_x,
+                            const PhiField& phi,
+                            const std::array<double, 4>& r,
+                            RandomStream& random, ClusterWorkspace& cluster){
+
+  // halo copies are not grown into, they belong to another process
+  if(y < phi.local_volume() && !cluster.visited(y)){
+    double scalar_y = phi[0][y]*r[0] + phi[1][y]*r[1] +
+                      phi[2][y]*r[2] + phi[3][y]*r[3];
+    double dS = scalar_x * scalar_y;
+    if((dS < 0.0) && (1.-exp(dS)) > random.plain())
+      cluster.visit(y); // y will be used as a starting point later on
+  }
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline double cluster_update(PhiField& phi, ClusterWorkspace& cluster,
+                             RandomStreams& streams,
+                             const double kappa, const double min_size){
+
+  // the cluster is built serially, one stream per process and step
+  RandomStream random = streams.process_stream(streams.next_step());
+  const size_t nvol = phi.local_volume();
+  wall_clock::time_point growth_begin = wall_clock::now();
+  size_t nb_clusters = 0, retries = 0;
+  cluster.start();
+
+  // vector which defines rotation plane ---------------------------------------
+  std::array<double, 4> r =
+                         {{random.plain()*2.-1., random.plain()*2.-1.,
+                           random.plain()*2.-1., random.plain()*2.-1.}};
+  double len = sqrt(r[0]*r[0] + r[1]*r[1] + r[2]*r[2] + r[3]*r[3]);
+  r[0]/=len; r[1]/=len; r[2]/=len; r[3]/=len; // normalisation
+
+  // while-loop: until at least some percentage of the lattice is updated ------
+  while(double(cluster.members())/nvol <= min_size){
+
+    // Choose a random START POINT for the cluster: 0 <= xx < volume and check
+    // if the point is already part of another cluster - if so another start
+    // point is choosen
+    size_t xx = size_t(random.plain()*nvol);
+    while(cluster.visited(xx)){
+      xx = size_t(random.plain()*nvol);
+      retries++;
+    }
+    cluster.visit(xx);
+    nb_clusters++;
+
+    // grow from the frontier until there are no more points to update ---------
+    while(!cluster.frontier_empty()){
+      const size_t x_look = cluster.pop_frontier();
+      double scalar_x = -4.*kappa * (phi[0][x_look]*r[0] + phi[1][x_look]*r[1] +
+                                     phi[2][x_look]*r[2] + phi[3][x_look]*r[3]);
+      for(size_t dir = 0; dir < 4; dir++){
+        // negative direction
+        check_neighbour(phi.neighbour(dir, x_look), scalar_x, phi, r, random,
+                        cluster);
+        // positive direction
+        check_neighbour(phi.neighbour(dir+4, x_look), scalar_x, phi, r, random,
+                        cluster);
+      }
+    } // while loop to build the cluster ends here
+  } // while loop to ensure minimal total cluster size ends here
+
+  profile().add_time(TIMER_CLUSTER_GROWTH, wall_clock::now() - growth_begin);
+  profile().count(COUNTER_CLUSTER_UPDATES);
+  profile().count(COUNTER_CLUSTERS, nb_clusters);
+  profile().count(COUNTER_SEED_RETRIES, retries);
+  profile().count(COUNTER_FLIPPED_SITES, cluster.members());
+
+  // perform the phi flip on the cluster members -------------------------------
+  {
+    ScopedTimer timer(TIMER_CLUSTER_FLIP);
+    FieldSums change;
+    for(size_t i = 0; i < cluster.members(); i++){
+      const size_t x = cluster[i];
+      const PhiField::site_t before = phi.site(x);
+      double scalar = -2.*(phi[0][x]*r[0] + phi[1][x]*r[1] +
+                           phi[2][x]*r[2] + phi[3][x]*r[3]);
+      for(int dir = 0; dir < 4; dir++)
+        phi[dir][x] += scalar*r[dir];
+      change.add_change(before, phi.site(x));
+    }
+    phi.add_to_sums(change);
+  }
+  phi.update(EVEN); // communicate boundaries
+  phi.update(ODD);
+
+  return cluster.members();
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// random start configuration with components uniform in [-delta, delta)
+inline void random_start(PhiField& phi, RandomStreams& streams,
+                         const double delta){
+
+  const uint64_t step = streams.next_step();
+  #pragma omp parallel for schedule(static)
+  for(size_t x = 0; x < phi.local_volume(); x++){
+    RandomStream random = streams.stream(step, phi.global_index(x));
+    for(size_t comp = 0; comp < 4; comp++)
+      phi[comp][x] = (random.plain()*2. - 1.)*delta;
+  }
+  phi.resum();
+  phi.update(EVEN); // communicate boundaries
+  phi.update(ODD);
+}
+
+} // end of namespace
+
+#endif // UPDATES_H_
@@ -0,0 +1,323 @@
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mdp.h"
+
+#include "cluster_workspace.h"
+#include "hmc.h"
+#include "local_updates.h"
+#include "measurements.h"
+#include "momentum_bins.h"
+#include "phi_field.h"
+#include "propagator_fft.h"
+#include "random_streams.h"
+#include "updates.h"
+#include "metropolis_simd.h"
+#include "swendsen_wang.h"
+
+// Micro-benchmarks of the update and measurement kernels of the soa backend
+// over a matrix of lattice sizes, kappa values and Metropolis hits:
+//
+//   ./benchmark [-L 8,16] [-k 0.126,0.1313] [-n 1,10] [-s 20] [-t threads]
+//               [-o benchmark.csv] [-b baseline.csv] [-x 0.1]
+//
+// -L are the extents of L^4 lattices, -k the kappa values (lambda = 0.15 in
+// the continuum formulation), -n the Metropolis hits and -s the sweeps timed
+// per entry. Every entry is one line of the csv file -o with wall clock
+// seconds per call, sites, random numbers and (nominal) bytes of field data
+// per second and the mean cluster size. With -b the sites per second are
+// compared to a csv file of an earlier run; the program returns 1 if any
+// entry is slower by more than the fraction -x.
+//
+// The mdp field kernels of the drivers (rotate_phi_field, Rescale,
+// Projection) are replaced in the soa backend by the running sums and by
+// measure_projections, which are benchmarked instead.
+
+const double lambda_continuum = 0.15;
+const double metropolis_delta = 4.7;
+const double cluster_min_size = 0.1;
+
+struct result_t {
+  std::string benchmark;
+  int L, hits;
+  double kappa, seconds, sites, randoms, bytes, cluster_size;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// comma separated numbers
+template<class T>
+inline std::vector<T> read_list(const char* value){
+
+  std::vector<T> list;
+  std::stringstream stream(value);
+  std::string item;
+  while(std::getline(stream, item, ','))
+    list.push_back(T(atof(item.c_str())));
+  return list;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// wall clock seconds of one call of f, averaged over the processes
+template<class F>
+inline double time_calls(const int calls, F f){
+
+  const auto begin = std::chrono::steady_clock::now();
+  for(int i = 0; i < calls; i++)
+    f();
+  double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin).count();
+  mdp.add(seconds);
+  return seconds/mdp.nproc()/calls;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+inline std::string key(const result_t& r){
+
+  std::ostringstream s;
+  s << r.benchmark << "," << r.L << "," << r.kappa << "," << r.hits;
+  return s.str();
+
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// sites per second of every entry of an earlier csv file
+inline std::map<std::string, double> read_baseline(const std::string& name){
+
+  std::map<std::string, double> baseline;
+  std::ifstream file(name);
+  if(!file){
+    mdp << "Could not open baseline " << name << endl;
+    exit(0);
+  }
+  std::string line;
+  std::getline(file, line); // header
+  while(std::getline(file, line)){
+    std::vector<std::string> column;
+    std::stringstream stream(line);
+    std::string item;
+    while(std::getline(stream, item, ','))
+      column.push_back(item);
+    if(column.size() < 7)
+      continue;
+    result_t r;
+    r.benchmark = column[0];
+    r.L = atoi(column[1].c_str());
+    r.kappa = atof(column[2].c_str());
+    r.hits = atoi(column[3].c_str());
+    baseline[key(r)] = atof(column[6].c_str());
+  }
+  return baseline;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv) {
+
+  mdp.open_wormholes(argc,argv);
+
+  std::vector<int> sizes = {8, 16};
+  std::vector<double> kappas = {0.126, 0.1313};
+  std::vector<int> hit_counts = {1, 10};
+  int sweeps = 20, threads = 0;
+  double tolerance = 0.1; // of the baseline comparison
+  std::string output = "benchmark.csv", baseline_file;
+  for(int i = 1; i + 1 < argc; i += 2){
+    if(std::strcmp(argv[i], "-L") == 0)
+      sizes = read_list<int>(argv[i+1]);
+    else if(std::strcmp(argv[i], "-k") == 0)
+      kappas = read_list<double>(argv[i+1]);
+    else if(std::strcmp(argv[i], "-n") == 0)
+      hit_counts = read_list<int>(argv[i+1]);
+    else if(std::strcmp(argv[i], "-s") == 0)
+      sweeps = atoi(argv[i+1]);
+    else if(std::strcmp(argv[i], "-t") == 0)
+      threads = atoi(argv[i+1]);
+    else if(std::strcmp(argv[i], "-o") == 0)
+      output = argv[i+1];
+    else if(std::strcmp(argv[i], "-b") == 0)
+      baseline_file = argv[i+1];
+    else if(std::strcmp(argv[i], "-x") == 0)
+      tolerance = atof(argv[i+1]);
+  }
+  if(sweeps < 1){
+    mdp << "the number of sweeps must be at least 1!" << endl;
+    exit(0);
+  }
+  mdp << "\tbenchmarking with " << cluster::init_threads(threads)
+      << " thread(s) per process" << endl;
+
+  // the kernels of this build
+  std::vector<std::pair<std::string, cluster::metropolis_kernel_t> > kernels =
+                                  {{"scalar", cluster::METROPOLIS_SCALAR}};
+#if defined(__AVX2__)
+  kernels.push_back({"avx2", cluster::METROPOLIS_AVX2});
+#endif
+#if defined(__AVX512F__)
+  kernels.push_back({"avx512", cluster::METROPOLIS_AVX512});
+#endif
+
+  std::vector<result_t> results;
+  auto add = [&](const std::string& name, const int L, const double kappa,
+                 const int hits, const double seconds, const double randoms,
+                 const double bytes, const double cluster_size){
+    const double V = double(L)*L*L*L;
+    results.push_back({name, L, hits, kappa, seconds, V/seconds,
+                       randoms/seconds, bytes/seconds, cluster_size});
+    mdp << "\t" << name << "\tL = " << L << "\tkappa = " << kappa
+        << "\thits = " << hits << "\t" << V/seconds << " sites/s" << endl;
+  };
+
+  for(const int size : sizes){
+    int L[] = {size, size, size, size};
+    const double V = double(size)*size*size*size;
+    mdp_lattice hypercube(4,L);
+    mdp_field<std::array<double, 4> > phi(hypercube);
+    mdp_site x(hypercube);
+    cluster::PhiField phi_soa(phi, x);
+    cluster::RandomStreams streams(1227, 0);
+    cluster::ClusterWorkspace workspace(phi_soa.local_volume());
+    cluster::SwendsenWang sw(phi_soa, x);
+
+    for(const double kappa : kappas){
+      const double lambda = 4.*kappa*kappa*lambda_continuum;
+      // a few sweeps from a random start, so acceptance and clusters are
+      // those of a run
+      cluster::random_start(phi_soa, streams, 1.);
+      for(int i = 0; i < 10; i++){
+        cluster::metropolis_update(phi_soa, streams, kappa, lambda,
+                                   metropolis_delta, 10);
+        sw.update(phi_soa, streams, kappa);
+      }
+
+      // Metropolis: two random numbers per component and hit, the site and
+      // its eight neighbours are read, the site and the sums are written
+      const double metropolis_bytes = V*(40.*sizeof(cluster::real_t) + 8.*sizeof(int));
+      for(const int hits : hit_counts)
+        for(const auto& kernel : kernels){
+          const double seconds = time_calls(sweeps, [&](){
+            cluster::metropolis_update(phi_soa, streams, kernel.second, kappa,
+                                       lambda, metropolis_delta, hits);
+          });
+          add("metropolis_" + kernel.first, size, kappa, hits, seconds,
+              8.*hits*V, metropolis_bytes, 0.);
+        }
+      // overrelaxation draws at most one random number per component, the
+      // heatbath at least three
+      add("overrelaxation", size, kappa, 0, time_calls(sweeps, [&](){
+        cluster::overrelaxation_update(phi_soa, streams, kappa, lambda);
+      }), 4.*V, metropolis_bytes, 0.);
+      add("heatbath", size, kappa, 0, time_calls(sweeps, [&](){
+        cluster::heatbath_update(phi_soa, streams, kappa, lambda);
+      }), 12.*V, metropolis_bytes, 0.);
+      // the HMC force: the site and its neighbours are read, four doubles
+      // written
+      std::array<std::vector<double>, 4> force;
+      for(auto& f : force)
+        f.resize(phi_soa.local_volume());
+      const std::array<double*, 4> force_ptr = {{force[0].data(),
+                      force[1].data(), force[2].data(), force[3].data()}};
+      for(const auto& kernel : kernels)
+        add("hmc_force_" + kernel.first, size, kappa, 0,
+            time_calls(sweeps, [&](){
+          cluster::hmc_force(phi_soa, kernel.second, kappa, lambda, force_ptr);
+        }), 0., V*(36.*sizeof(cluster::real_t) + 8.*sizeof(int) +
+                   4.*sizeof(double)), 0.);
+
+      // cluster updates, the random numbers depend on the clusters
+      if(mdp.nproc() == 1){ // min_size clusters do not cross processes
+        double members = 0.;
+        const double seconds = time_calls(sweeps, [&](){
+          members += cluster::cluster_update(phi_soa, workspace, streams,
+                                             kappa, cluster_min_size);
+        });
+        add("cluster_min_size", size, kappa, 0, seconds, 0., 0.,
+            members/sweeps/V);
+      }
+      double flipped = 0.;
+      const double seconds = time_calls(sweeps, [&](){
+        flipped += sw.update(phi_soa, streams, kappa);
+      });
+      mdp.add(flipped);
+      add("cluster_swendsen_wang", size, kappa, 0, seconds, 0., 0.,
+          flipped/sweeps/V);
+    }
+
+    // measurements: the magnetisation from the running sums, which replaces
+    // rotate_phi_field, the projections, which replace Rescale and
+    // Projection, the FFT with the binning and the binning alone
+    const double kappa = kappas.empty() ? 0.13 : kappas.back();
+    double M = 0.;
+    add("magnetisation", size, 0., 0, time_calls(sweeps, [&](){
+      M += phi_soa.magnetisation();
+    }), 0., 0., 0.);
+    cluster::PropagatorFFT fft(L, phi_soa, ".");
+    add("projections", size, 0., 0, time_calls(sweeps, [&](){
+      cluster::measure_projections(phi_soa, kappa, fft);
+    }), 0., V*(4.*sizeof(cluster::real_t) + 5.*sizeof(double) + sizeof(int)), 0.);
+    std::vector<double> higgs, goldstone;
+    add("fft_binning", size, 0., 0, time_calls(sweeps, [&](){
+      fft.measure(higgs, goldstone);
+    }), 0., V*10.*sizeof(double), 0.);
+    const cluster::MomentumBins& bins = fft.momentum_bins();
+    std::vector<double> transform(2*5*bins.half_volume());
+    for(size_t i = 0; i < transform.size(); i++)
+      transform[i] = 1./(1. + i%7);
+    add("binning", size, 0., 0, time_calls(sweeps, [&](){
+      bins.accumulate(reinterpret_cast<const fftw_complex*>(transform.data()),
+                      higgs, goldstone);
+    }), 0., bins.half_volume()*(5.*sizeof(fftw_complex) + 2.*sizeof(int)),
+    0.);
+  }
+
+  // csv output and comparison with the baseline
+  std::map<std::string, double> baseline;
+  if(!baseline_file.empty())
+    baseline = read_baseline(baseline_file);
+  bool regression = false;
+  FILE* f = (mdp.me() == 0) ? fopen(output.c_str(), "w") : NULL;
+  if(mdp.me() == 0 && f == NULL){
+    mdp << "Could not write " << output << endl;
+    exit(0);
+  }
+  if(f != NULL)
+    fprintf(f, "benchmark,L,kappa,hits,threads,seconds,sites_per_second,"
+               "randoms_per_second,bytes_per_second,cluster_size,"
+               "baseline_ratio\n");
+  for(const auto& r : results){
+    double ratio = 0.;
+    const auto b = baseline.find(key(r));
+    if(b != baseline.end() && b->second > 0.){
+      ratio = r.sites/b->second;
+      if(ratio < 1. - tolerance){
+        regression = true;
+        mdp << "\tslower than the baseline: " << r.benchmark << " L = " << r.L
+            << " kappa = " << r.kappa << " hits = " << r.hits << ", "
+            << ratio << " of its sites/s" << endl;
+      }
+    }
+    if(f != NULL)
+      fprintf(f, "%s,%d,%g,%d,%d,%.6e,%.6e,%.6e,%.6e,%.6f,%.4f\n",
+              r.benchmark.c_str(), r.L, r.kappa, r.hits,
+              cluster::init_threads(0), r.seconds, r.sites, r.randoms,
+              r.bytes, r.cluster_size, ratio);
+  }
+  if(f != NULL)
+    fclose(f);
+  mdp << "\tresults written to " << output << endl;
+
+  mdp.close_wormholes();
+  return regression ? 1 : 0;
+}
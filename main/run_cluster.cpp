@@ -1,11 +1,24 @@
+#include <algorithm>
 #include <array>
 #include <cmath>
-#include <ctime>
+#include <memory>
 #include <vector>
 
 #include "mdp.h"
 
 #include "IO_params.h" 
+#include "autocorrelation.h"
+#include "autotune.h"
+#include "chain_bundle.h"
+#include "checkpoint_writer.h"
+#include "hmc.h"
+#include "local_updates.h"
+#include "observable_file.h"
+#include "phi_field.h"
+#include "replica_exchange.h"
+#include "updates.h"
+#include "metropolis_simd.h"
+#include "swendsen_wang.h"
 
 // the random number generator
 mdp_random_generator random1;
@@ -78,24 +91,47 @@ inline void rotate_phi_field_component(mdp_field<std::array<double, 4> >& phi,
 }
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+inline void rotate_direction(std::array<double, 4>& dir, const int ind1, 
+                             const int ind2, const double w){
+  double c = cos (w);
+  double s = sin (w);
+
+  double y = dir[ind1];
+  double z = dir[ind2];
+  dir[ind1] =  c*y + s*z;
+  dir[ind2] = -s*y + c*z;
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// rotates the field such that its direction dir points along component 0. The
+// rotations are linear, so the direction of the rotated field is the rotated
+// direction and does not need another sweep.
 void rotate_phi_field (mdp_field<std::array<double, 4> >& phi, mdp_site& x,
-                       const double V) {
+                       std::array<double, 4> dir) {
 
   double angle;
-  std::array<double, 4> dir;
 
-  get_phi_field_direction (phi, x, dir, V);
   angle = get_angle (dir[1], dir[0]);
   rotate_phi_field_component (phi, x, 1, 0, -angle);
+  rotate_direction (dir, 1, 0, -angle);
 
-  get_phi_field_direction (phi, x, dir, V);
   angle = get_angle (dir[2], dir[0]);
   rotate_phi_field_component (phi, x, 2, 0, -angle);
+  rotate_direction (dir, 2, 0, -angle);
 
-  get_phi_field_direction (phi, x, dir, V);
   angle = get_angle (dir[3], dir[0]);
   rotate_phi_field_component (phi, x, 3, 0, -angle);
 
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void rotate_phi_field (mdp_field<std::array<double, 4> >& phi, mdp_site& x,
+                       const double V) {
+
+  std::array<double, 4> dir;
+  get_phi_field_direction (phi, x, dir, V);
+  rotate_phi_field (phi, x, dir);
+
 }
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -288,120 +324,421 @@ int main(int argc, char** argv) {
   mdp_field<std::array<double, 4> > phi(hypercube); // declare phi field
   mdp_site x(hypercube); // declare lattice lookuptable
 
+  // structure-of-arrays copy of phi on which the updates run, together with
+  // its counter-based random numbers. With chains > 1 the chains live in a
+  // ChainBundle, which runs their Metropolis sweeps in lockstep, and phi_soa
+  // holds one chain at a time for the cluster update and the measurements
+  const bool soa = (params.data.field_backend == "soa");
+  const size_t nb_chains = params.data.chains;
+  const bool lockstep = (nb_chains > 1);
+  cluster::PhiField phi_soa(phi, x);
+  cluster::ChainBundle bundle(phi_soa, lockstep ? nb_chains : 0);
+  std::vector<cluster::LatticeDataContainer> chains;
+  std::vector<cluster::RandomStreams> streams;
+  for(size_t k = 0; k < nb_chains; k++){
+    chains.push_back(params.chain(k));
+    streams.emplace_back(chains[k].seed, chains[k].replica);
+  }
+  const cluster::metropolis_kernel_t kernel = 
+              cluster::get_metropolis_kernel(params.data.metropolis_kernel);
+  const int threads = cluster::init_threads(params.data.threads);
+  mdp << "\tupdating with " << threads << " thread(s) per process" << endl;
+  if(lockstep)
+    mdp << "\t" << nb_chains << " chains in lockstep" << endl;
+  // with swap_every_X_updates > 0 the chains are the walkers of a parallel 
+  // tempering ladder: chain k holds the couplings of slot ladder.slot(k), 
+  // measurements and checkpoints belong to the slot
+  const bool tempering = (params.data.swap_every_X_updates > 0);
+  cluster::ReplicaExchange ladder(params.data.chain_kappa, 
+                                  params.data.chain_lambda, params.data.seed, 
+                                  params.data.replica, 
+                                  params.data.swap_every_X_updates);
+#ifdef FLOAT_FIELD
+  if(soa)
+    mdp << "\tsoa field stored in single precision" << endl;
+#endif
+  const bool swendsen_wang = (params.data.cluster_algorithm == "swendsen_wang");
+  cluster::SwendsenWang sw(phi_soa, x);
+  cluster::ClusterWorkspace workspace(phi_soa.local_volume());
+
   random1.initialize(1227);
 
-  // random start configuration
-  forallsites(x)
-    phi(x) = create_phi_update(1.); 
-
-  // compute magnetisation on start config
-  rotate_phi_field(phi, x, double(V));
-  double M = compute_magnetisation(phi, x);
-  mdp.add(M);
-  mdp << "\n\n\tmagnetization at start = " << M/V << endl;
-
-  std::string mag_file = params.data.outpath + 
-                         "/mag.T" + std::to_string(params.data.L[0]) +
-                         "X" + std::to_string(params.data.L[1]) +
-                         "Y" + std::to_string(params.data.L[2]) +
-                         "Z" + std::to_string(params.data.L[3]) +
-                         "kap" + std::to_string(params.data.kappa) + 
-                         "lam" + std::to_string(params.data.lambda) + ".dat";
-  FILE *f_mag = fopen(mag_file.c_str(), "w"); 
-  if (f_mag == NULL) {
-      printf("Error opening file!\n");
-      exit(1);
-  }
-  if(params.data.restart != 0){
-    std::string conf_file = params.data.outpath + 
-                            "/T" + std::to_string(params.data.L[0]) +
-                            ".X" + std::to_string(params.data.L[1]) +
-                            ".Y" + std::to_string(params.data.L[2]) +
-                            ".Z" + std::to_string(params.data.L[3]) +
-                            ".kap" + std::to_string(params.data.kappa) + 
-                            ".lam" + std::to_string(params.data.lambda)+
-                            ".conf" + std::to_string(params.data.restart);
-    phi.load(conf_file.c_str());
-    std::string rnd_state_filename = params.data.outpath + 
-                            "/T" + std::to_string(params.data.L[0]) +
-                            ".X" + std::to_string(params.data.L[1]) +
-                            ".Y" + std::to_string(params.data.L[2]) +
-                            ".Z" + std::to_string(params.data.L[3]) +
-                            ".kap" + std::to_string(params.data.kappa) + 
-                            ".lam" + std::to_string(params.data.lambda)+
-                            ".conf" + std::to_string(params.data.restart) + 
-                            ".random_generator_state";
-    random1.read_state(rnd_state_filename);
+  // configurations are saved per chain, the replica is part of the name as
+  // soon as there are several chains
+  auto conf_name = [&](const cluster::LatticeDataContainer& chain, 
+                       const int iteration){
+    return params.data.outpath + 
+           "/T" + std::to_string(params.data.L[0]) +
+           ".X" + std::to_string(params.data.L[1]) +
+           ".Y" + std::to_string(params.data.L[2]) +
+           ".Z" + std::to_string(params.data.L[3]) +
+           ".kap" + std::to_string(chain.kappa) + 
+           ".lam" + std::to_string(chain.lambda) +
+           (lockstep ? ".rep_" + std::to_string(chain.replica) : "") +
+           ".conf" + std::to_string(iteration);
+  };
+
+  // all observables of a chain in one binary file, see observable_file.h
+  std::vector<std::unique_ptr<cluster::ObservableFile> > observables;
+  int first_iteration = 0;
+  double M;
+  for(size_t k = 0; k < nb_chains; k++){
+    const cluster::LatticeDataContainer& chain = chains[k];
+
+    // random start configuration
+    if(soa){
+      random_start(phi_soa, streams[k], 1.);
+      phi_soa.store();
+    }
+    else
+      forallsites(x)
+        phi(x) = create_phi_update(1.); 
+
+    // compute magnetisation on start config
+    if(soa){ // from the running sums, the rotation keeps the length
+      rotate_phi_field(phi, x, phi_soa.global_sums().phi);
+      M = phi_soa.magnetisation();
+    }
+    else{
+      rotate_phi_field(phi, x, double(V));
+      M = compute_magnetisation(phi, x);
+      mdp.add(M);
+    }
+    mdp << "\n\n\tmagnetization at start = " << M/V << endl;
+
+    // the iteration of the checkpoint, the observable file is cut after it
+    int64_t conf_iteration = -1;
+    if(params.data.restart != 0){
+      std::string conf_file = conf_name(chain, params.data.restart);
+      std::string random_state;
+      const bool checkpoint = cluster::read_checkpoint(conf_file, phi_soa, L, 
+                                                       conf_iteration, 
+                                                       random_state);
+      if(checkpoint && !random_state.empty()){
+        // field, random state and running sums in one file, the chain goes on
+        // where it was saved
+        if(soa)
+          streams[k].set_state(random_state);
+        else
+          cluster::set_random_state(random1, random_state, conf_file + 
+                                    ".random_state" + std::to_string(mdp.me()));
+      }
+      else{ // older files, the random state is kept separately
+        conf_iteration = params.data.restart;
+        if(!checkpoint && cluster::is_checkpoint(conf_file)){
+          mdp << "Could not restart from " << conf_file << endl;
+          exit(1);
+        }
+        if(!checkpoint)
+          phi.load(conf_file.c_str()); // written by mdp_field::save
+        std::string rnd_state_filename = conf_file + ".random_generator_state";
+        if(soa){
+          streams[k].read_state(rnd_state_filename);
+          phi_soa.load(); 
+        }
+        else
+          random1.read_state(rnd_state_filename);
+      }
+      // all chains have to go on after the same iteration
+      if(k > 0 && conf_iteration + 1 != first_iteration){
+        mdp << "The checkpoints of the chains were written after different "
+            << "iterations, could not restart from " << conf_file << endl;
+        exit(1);
+      }
+      first_iteration = conf_iteration + 1;
+    }
+    else if(soa)
+      phi_soa.load(); // start configuration
+    if(lockstep)
+      bundle.load(k);
+
+    std::string obs_file = params.data.outpath + 
+                           "/observables.T" + std::to_string(params.data.L[0]) +
+                           ".X" + std::to_string(params.data.L[1]) +
+                           ".Y" + std::to_string(params.data.L[2]) +
+                           ".Z" + std::to_string(params.data.L[3]) +
+                           ".kap" + std::to_string(chain.kappa) + 
+                           ".lam" + std::to_string(chain.lambda) + 
+                           ".rep_" + std::to_string(chain.replica) + 
+                           ".seed" + std::to_string(chain.seed) + ".bin";
+    observables.emplace_back(new cluster::ObservableFile(obs_file, chain,
+                                        {{"magnetisation", 1}, 
+                                         {"acceptance", 1},
+                                         {"cluster_size", 1}},
+                                        {}, conf_iteration));
   }
 
   std::vector<int> look_1(V, -1), look_2(V, -1); // lookuptables for the cluster
-  // The update ----------------------------------------------------------------
-  for(int ii = 0; ii < params.data.start_measure+params.data.total_measure; ii++) {
-
-    clock_t begin = clock(); // start time for one update step
-    // metropolis update
-    double acc = 0.0;
-    for(int global_metro_hits = 0; 
-        global_metro_hits < params.data.metropolis_global_hits; 
-        global_metro_hits++)
-      acc += metropolis_update(phi, x, params.data.kappa, params.data.lambda, 
-                               params.data.metropolis_delta, 
-                               params.data.metropolis_local_hits);
-    acc /= params.data.metropolis_global_hits;
-
-    clock_t mid = clock(); // start time for one update step
-
-    // cluster update
+
+  // with autotune = yes the thermalisation sweeps of a new run tune delta and
+  // the hits, see autotune.h; a restart takes the values written then
+  const bool autotune = (params.data.autotune == "yes");
+  cluster::AutoTuner tuner((autotune && params.data.restart == 0) ? 
+                           params.data.start_measure : 0,
+                           params.data.metropolis_delta, 
+                           params.data.metropolis_local_hits, 
+                           params.data.cluster_hits, 
+                           params.data.target_acceptance);
+  const std::string tune_file = params.data.outpath + 
+                           "/autotune.T" + std::to_string(params.data.L[0]) +
+                           ".X" + std::to_string(params.data.L[1]) +
+                           ".Y" + std::to_string(params.data.L[2]) +
+                           ".Z" + std::to_string(params.data.L[3]) +
+                           ".rep_" + std::to_string(params.data.replica) + 
+                           ".seed" + std::to_string(params.data.seed) + 
+                           ".dat";
+  if(autotune && params.data.restart != 0){
+    if(!tuner.read(tune_file)){
+      mdp << "Could not read the tuned parameters from " << tune_file << endl;
+      exit(0);
+    }
+    mdp << tuner.summary() << endl;
+  }
+
+  // checkpoints are written in the background, only the newest keep_configs
+  // of every chain are kept (all for 0)
+  cluster::CheckpointWriter checkpoints(L, 
+                                   params.data.config_compression == "fpc",
+                                   params.data.keep_configs);
+
+  // streaming autocorrelation of |M| of every chain (autocorrelation.h) and 
+  // the wall clock time since the first measured iteration
+  std::vector<cluster::BinningAnalysis> analysis(nb_chains);
+  cluster::wall_clock::time_point measure_begin;
+  auto measure_seconds = [&](){
+    return cluster::elapsed_seconds(cluster::wall_clock::now() - measure_begin);
+  };
+
+  // the steps of one iteration (update_schedule): the steps up to the last
+  // metropolis step run first, the others after it chain by chain together
+  // with the measurements
+  const std::vector<cluster::update_step_t> schedule = 
+                    cluster::get_update_schedule(params.data.update_schedule);
+  const int nb_metropolis = std::count(schedule.begin(), schedule.end(), 
+                                       cluster::STEP_METROPOLIS);
+  const int nb_cluster = std::count(schedule.begin(), schedule.end(), 
+                                    cluster::STEP_CLUSTER);
+  size_t tail = 0;
+  for(size_t s = 0; s < schedule.size(); s++)
+    if(schedule[s] == cluster::STEP_METROPOLIS)
+      tail = s + 1;
+  // hybrid Monte Carlo trajectories, only if the schedule has them (hmc.h)
+  std::unique_ptr<cluster::HybridMonteCarlo> hmc;
+  if(std::count(schedule.begin(), schedule.end(), cluster::STEP_HMC) > 0)
+    hmc.reset(new cluster::HybridMonteCarlo(L, phi_soa, params.data.outpath, 
+                        kernel, params.data.hmc_integrator == "leapfrog" ? 
+                        cluster::HMC_LEAPFROG : cluster::HMC_OMELYAN,
+                        params.data.hmc_steps, 
+                        params.data.hmc_trajectory_length,
+                        params.data.hmc_fourier_mass));
+  // an overrelaxation, heatbath, hmc or cluster step of chain k, which is in
+  // phi_soa (or phi), returns the summed cluster sizes
+  auto chain_step = [&](const cluster::update_step_t step, const size_t k){
+    const cluster::LatticeDataContainer& chain = chains[ladder.slot(k)];
     double cluster_size = 0.0;
-    for(size_t nb = 0; nb < params.data.cluster_hits; nb++)
-      cluster_size += cluster_update(phi, x, look_1, look_2, params.data.kappa, 
-                                     params.data.cluster_min_size);
-    cluster_size /= params.data.cluster_hits;
-    clock_t end = clock(); // end time for one update step
-
-    // compute magnetisation every ZZZ configuration
-    if(ii > params.data.start_measure &&
-       ii%params.data.measure_every_X_updates == 0){
-      mdp_field<std::array<double, 4> > phi_rot(phi); // copy field
-      rotate_phi_field(phi_rot, x, double(V)); 
-      M = compute_magnetisation(phi_rot, x);
-      mdp.add(M); // adding magnetisation and acceptance rate in parallel
-      mdp.add(acc);
-      mdp << ii << "\tmag after rot = " << M/V;
-      mdp << "  \tacc. rate = " << acc/V 
-          << "  \tcluster size = " << 100.*cluster_size/V 
-          << "\ttime metro = " << double(mid - begin) / CLOCKS_PER_SEC 
-          << "\ttime clust = " << double(end - mid) / CLOCKS_PER_SEC 
-          << endl;
-      fprintf(f_mag, "%.14lf\n", M/V);
-      fflush(f_mag);
+    if(step == cluster::STEP_OVERRELAXATION)
+      cluster::overrelaxation_update(phi_soa, streams[k], chain.kappa, 
+                                     chain.lambda);
+    else if(step == cluster::STEP_HEATBATH)
+      cluster::heatbath_update(phi_soa, streams[k], chain.kappa, chain.lambda);
+    else if(step == cluster::STEP_HMC)
+      hmc->trajectory(phi_soa, streams[k], chain.kappa, chain.lambda);
+    else
+      for(int nb = 0; nb < tuner.cluster_hits(); nb++)
+        if(swendsen_wang)
+          cluster_size += sw.update(phi_soa, streams[k], chain.kappa);
+        else if(soa)
+          cluster_size += cluster_update(phi_soa, workspace, streams[k], 
+                                         chain.kappa, 
+                                         params.data.cluster_min_size);
+        else
+          cluster_size += cluster_update(phi, x, look_1, look_2, 
+                                         params.data.kappa, 
+                                         params.data.cluster_min_size);
+    return cluster_size;
+  };
+
+  // wall clock timers and counters of the update loop, see instrumentation.h,
+  // written every profile_every_X_updates iterations and at the end
+  const std::string profile_file = params.data.outpath + 
+                           "/profile.T" + std::to_string(params.data.L[0]) +
+                           ".X" + std::to_string(params.data.L[1]) +
+                           ".Y" + std::to_string(params.data.L[2]) +
+                           ".Z" + std::to_string(params.data.L[3]) +
+                           ".rep_" + std::to_string(params.data.replica) + 
+                           ".seed" + std::to_string(params.data.seed) + 
+                           ".json";
+  cluster::profile().reset();
+
+  // The update ----------------------------------------------------------------
+  for(int ii = first_iteration; 
+      ii < params.data.start_measure+params.data.total_measure; ii++) {
+
+    const auto begin = cluster::wall_clock::now(); // start time for one update step
+    if(ii == std::max(first_iteration, params.data.start_measure + 1))
+      measure_begin = cluster::wall_clock::now();
+    const bool tuning = tuner.tuning();
+    // the steps up to the last metropolis step, metropolis on all chains at
+    // once, the others chain by chain
+    std::vector<double> acc(nb_chains, 0.0), cluster_size(nb_chains, 0.0);
+    for(size_t s = 0; s < tail; s++)
+      if(schedule[s] == cluster::STEP_METROPOLIS)
+        for(int global_metro_hits = 0; 
+            global_metro_hits < params.data.metropolis_global_hits; 
+            global_metro_hits++)
+          if(lockstep)
+            metropolis_update(bundle, streams, kernel, ladder.kappa(),
+                              ladder.lambda(), 
+                              tuner.delta(), 
+                              tuner.local_hits(), acc);
+          else if(soa)
+            acc[0] += metropolis_update(phi_soa, streams[0], kernel, 
+                                        params.data.kappa, params.data.lambda, 
+                                        tuner.delta(), 
+                                        tuner.local_hits());
+          else
+            acc[0] += metropolis_update(phi, x, params.data.kappa, 
+                                        params.data.lambda, 
+                                        tuner.delta(), 
+                                        tuner.local_hits());
+      else
+        for(size_t k = 0; k < nb_chains; k++){
+          if(lockstep)
+            bundle.store(k);
+          cluster_size[k] += chain_step(schedule[s], k);
+          if(lockstep)
+            bundle.load(k);
+        }
+    if(nb_metropolis > 0)
+      for(auto& a : acc)
+        a /= params.data.metropolis_global_hits*nb_metropolis;
+
+    const auto mid = cluster::wall_clock::now(); // start time for one update step
+    // what the tuner needs: acceptance, |M| and wall clock time of the updates
+    std::vector<double> rate(acc), mag(nb_chains, 0.);
+    double seconds = cluster::elapsed_seconds(mid - begin);
+
+    // the remaining steps and the measurement chain by chain
+    for(size_t k = 0; k < nb_chains; k++){
+      const size_t slot = ladder.slot(k);
+      const auto cluster_begin = cluster::wall_clock::now();
+      if(lockstep)
+        bundle.store(k);
+
+      for(size_t s = tail; s < schedule.size(); s++)
+        cluster_size[k] += chain_step(schedule[s], k);
+      if(nb_cluster > 0)
+        cluster_size[k] /= nb_cluster*tuner.cluster_hits();
+      const auto end = cluster::wall_clock::now(); // end time for one update step
+      if(tuning){
+        mag[k] = phi_soa.magnetisation()/V;
+        seconds += cluster::elapsed_seconds(end - cluster_begin);
+      }
+
+      // compute magnetisation every ZZZ configuration
+      if(ii > params.data.start_measure &&
+         ii%params.data.measure_every_X_updates == 0){
+        cluster::ScopedTimer timer(cluster::TIMER_MEASUREMENT);
+        cluster::profile().count(cluster::COUNTER_MEASUREMENTS);
+        if(soa) // O(1) from the running sums, the rotation keeps the length
+          M = phi_soa.magnetisation();
+        else{
+          mdp_field<std::array<double, 4> > phi_rot(phi); // copy field
+          rotate_phi_field(phi_rot, x, double(V)); 
+          M = compute_magnetisation(phi_rot, x);
+          mdp.add(M); // adding magnetisation in parallel
+        }
+        mdp.add(acc[k]);
+        analysis[slot].add(M/V);
+        mdp << ii;
+        if(lockstep)
+          mdp << "\tchain " << slot;
+        if(tempering)
+          mdp << " walker " << k;
+        mdp << "\tmag after rot = " << M/V;
+        mdp << "  \tacc. rate = " << acc[k]/V 
+            << "  \tcluster size = " << 100.*cluster_size[k]/V 
+            << "\ttime metro = " << cluster::elapsed_seconds(mid - begin) 
+            << "\ttime clust = " << cluster::elapsed_seconds(end - cluster_begin) 
+            << "\ttau_int = " << analysis[slot].tau_int() 
+            << "\teff/s = " << analysis[slot].effective_samples()/measure_seconds()
+            << endl;
+        observables[slot]->record(ii); // only written by process 0
+        observables[slot]->put(M/V);
+        observables[slot]->put(acc[k]/V);
+        observables[slot]->put(cluster_size[k]/V);
+      }
+      if(lockstep)
+        bundle.load(k);
     }
+    if(tempering)
+      ladder.swap(bundle, ii);
+    // checkpoints after the swaps, so a restart continues the ladder exactly
     if(params.data.save_config == "yes" && ii > params.data.start_measure &&
-       ii%params.data.save_config_every_X_updates == 0){
-      std::string conf_file = params.data.outpath + 
-                              "/T" + std::to_string(params.data.L[0]) +
-                              ".X" + std::to_string(params.data.L[1]) +
-                              ".Y" + std::to_string(params.data.L[2]) +
-                              ".Z" + std::to_string(params.data.L[3]) +
-                              ".kap" + std::to_string(params.data.kappa) + 
-                              ".lam" + std::to_string(params.data.lambda)+
-                              ".conf" + std::to_string(ii);
-      phi.save(conf_file.c_str());
-      std::string rnd_state_filename = params.data.outpath + 
-                              "/T" + std::to_string(params.data.L[0]) +
-                              ".X" + std::to_string(params.data.L[1]) +
-                              ".Y" + std::to_string(params.data.L[2]) +
-                              ".Z" + std::to_string(params.data.L[3]) +
-                              ".kap" + std::to_string(params.data.kappa) + 
-                              ".lam" + std::to_string(params.data.lambda)+
-                              ".conf" + std::to_string(ii) + 
-                              ".random_generator_state";
-      random1.write_state(rnd_state_filename);
+       ii%params.data.save_config_every_X_updates == 0)
+      for(size_t k = 0; k < nb_chains; k++){
+        std::string conf_file = conf_name(chains[ladder.slot(k)], ii);
+        if(lockstep)
+          bundle.store(k);
+        if(!soa) // the configuration is written from the soa layout
+          phi_soa.load();
+        checkpoints.save(phi_soa, ii, 
+                         soa ? streams[k].state() : 
+                         cluster::random_state(random1, conf_file + 
+                                  ".random_state" + std::to_string(mdp.me())),
+                         conf_file);
+      }
+    if(tuning){ // the same numbers on every process
+      for(auto& r : rate){
+        mdp.add(r);
+        r /= V;
+      }
+      mdp.add(seconds);
+      tuner.update(rate, mag, seconds/mdp.nproc());
+      if(!tuner.tuning()){
+        mdp << tuner.summary() << endl;
+        tuner.write(tune_file);
+      }
     }
+    if(params.data.profile_every_X_updates > 0 &&
+       ii%params.data.profile_every_X_updates == 0)
+      cluster::profile().write_json(profile_file, ii);
   }
 
   // end everything
-  fclose(f_mag);
+  checkpoints.finish(); // outstanding checkpoints
+  for(auto& o : observables)
+    o->close();
+  cluster::profile().write_json(profile_file, 
+                       params.data.start_measure+params.data.total_measure-1);
+  for(size_t s = 0; s < nb_chains; s++)
+    if(analysis[s].size() > 0){
+      if(lockstep)
+        mdp << "\tchain " << s;
+      mdp << "\t|M|/V = " << analysis[s].mean() << " +- " << analysis[s].error()
+          << ", tau_int = " << analysis[s].tau_int() << ", " 
+          << analysis[s].effective_samples() << " effective samples, "
+          << analysis[s].effective_samples()/measure_seconds() << " per second"
+          << endl;
+    }
+  if(hmc)
+    mdp << hmc->summary() << endl;
+  if(tempering){
+    for(size_t s = 0; s + 1 < nb_chains; s++)
+      mdp << "\tswaps kappa " << chains[s].kappa << " <-> " 
+          << chains[s+1].kappa << ": acceptance " << ladder.acceptance(s) 
+          << endl;
+    mdp << "\t" << ladder.nb_round_trips() << " round trips, mean length " 
+        << ladder.mean_round_trip() << " iterations" << endl;
+    ladder.write_statistics(params.data.outpath + 
+                            "/tempering.T" + std::to_string(params.data.L[0]) +
+                            ".X" + std::to_string(params.data.L[1]) +
+                            ".Y" + std::to_string(params.data.L[2]) +
+                            ".Z" + std::to_string(params.data.L[3]) +
+                            ".rep_" + std::to_string(params.data.replica) + 
+                            ".seed" + std::to_string(params.data.seed) + 
+                            ".dat");
+  }
   mdp.close_wormholes();
   return 0;
 }
@@ -1,6 +1,7 @@
 #include <array>
 #include <cmath>
-#include <ctime>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <algorithm>
 
@@ -9,6 +10,22 @@
 #include "mdp.h"
 
 #include "IO_params.h" 
+#include "autocorrelation.h"
+#include "autotune.h"
+#include "chain_bundle.h"
+#include "checkpoint_writer.h"
+#include "hmc.h"
+#include "local_updates.h"
+#include "measurement_pipeline.h"
+#include "measurements.h"
+#include "momentum_bins.h"
+#include "observable_file.h"
+#include "propagator_fft.h"
+#include "phi_field.h"
+#include "replica_exchange.h"
+#include "updates.h"
+#include "metropolis_simd.h"
+#include "swendsen_wang.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -49,6 +66,7 @@ inline void get_phi_field_unit_vec(mdp_field<std::array<double, 4> >& phi,
     dir[2] += phi(x)[2];
     dir[3] += phi(x)[3];
   }
+  mdp.add(&dir[0], 4); // direction of the whole lattice
   inv_length = 1/sqrt( dir[0]*dir[0] + dir[1]*dir[1] +
 		           dir[2]*dir[2] + dir[3]*dir[3] );
   for (int i = 0; i < 4; i++)
@@ -68,95 +86,23 @@ inline void Rescale(mdp_field<std::array<double, 4> >& phi_rescale,
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 inline void Projection(mdp_field<std::array<double, 4> >& phi, mdp_site& x,
-		                   fftw_complex* const output){
-		                   //std::vector<fftw_complex>& output){
+		                   cluster::PropagatorFFT& fft){
 
   std::array<double,4> dir;
   get_phi_field_unit_vec(phi, x, dir);
   
   forallsites(x){
+    double* const output = fft.projections() + 5*fft.slot_of_mdp(x.idx);
     // compute Higgs Projection
-    output[5*x.global_index()+0][0] = 
-                       phi(x)[0]*dir[0] + phi(x)[1]*dir[1] +
-		                   phi(x)[2]*dir[2] + phi(x)[3]*dir[3];
+    output[0] = phi(x)[0]*dir[0] + phi(x)[1]*dir[1] +
+		            phi(x)[2]*dir[2] + phi(x)[3]*dir[3];
 
     // compute Goldstone Projection
     for (int i = 0; i < 4; i++) 
-	    output[5*x.global_index()+1+i][0] = 
-                           phi(x)[i] - output[5*x.global_index()+0][0]*dir[i];
-    for(size_t i = 0; i < 5; i++)
-      output[5*x.global_index()+i][1] = 0.0;
+	    output[1+i] = phi(x)[i] - output[0]*dir[i];
 	}
 
 } // fingers crossed...
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-//double HProp(int comp, std::vector<fftw_complex>& output, const double V){
-inline double HProp(const int comp, fftw_complex const * const output, const double V){
-  double tmp = output[5*comp+0][0] * output[5*comp+0][0] +
-               output[5*comp+0][1] * output[5*comp+0][1];
-  return tmp/V;
-}
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-//double GProp(int comp, std::vector<fftw_complex>& output, const double V){
-inline double GProp(const int comp, fftw_complex const * const output, const double V){
-  double tmp = 0.0;
-  for (int i = 1; i < 5; i++)
-    tmp += output[5*comp+i][0] * output[5*comp+i][0]+
-           output[5*comp+i][1] * output[5*comp+i][1];
-
-  return tmp/(3*V);
-}
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-inline int Flag(const double momSqr, const int SlotCnt, 
-         const std::vector<double>& DifferentMomenta){
-
-  for (int I = 0; I < SlotCnt; I++){
-    if ( fabs( momSqr - DifferentMomenta[I] ) < 1E-9 ){
-      return I;
-    }
-  }
-  return -1;
-
-}
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-//double GetHiggsComponent(std::vector<fftw_complex>& output,
-inline double GetHiggsComponent(fftw_complex const * const output,
-                    const std::vector<double>& sinPSqr, 
-                    const std::vector<double>& DifferentMomenta, const int comp,
-                    const int V){
-  int counter = 0;
-  double tmp = 0.0;
-  for (int i = 0; i < V; i++){
-    if ( fabs(DifferentMomenta[comp]-sinPSqr[i]) < 1E-9 ){
-      tmp += HProp(i, output, V);
-      counter++;
-    }
-  }
-  return tmp/counter;
-
-}
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-//double GetGoldstoneComponent(std::vector<fftw_complex>& output,
-inline double GetGoldstoneComponent(fftw_complex const * const output,
-                    const std::vector<double>& sinPSqr, 
-                    const std::vector<double>& DifferentMomenta, const int comp,
-                    const int V){
-  int counter = 0;
-  double tmp = 0.0;
-  for (int i = 0; i < V; i++){
-    if ( fabs(DifferentMomenta[comp]-sinPSqr[i]) < 1E-9 ){
-      tmp += GProp(i, output, V);
-      counter++;
-    }
-  }
-  return tmp/counter;
-}
-
 ////////////////////////////////////////////////////////////////////////////////
 //////////////////// Only these are necessary, I hope... ///////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -209,24 +155,47 @@ inline void rotate_phi_field_component(mdp_field<std::array<double, 4> >& phi,
 }
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+inline void rotate_direction(std::array<double, 4>& dir, const int ind1, 
+                             const int ind2, const double w){
+  double c = cos (w);
+  double s = sin (w);
+
+  double y = dir[ind1];
+  double z = dir[ind2];
+  dir[ind1] =  c*y + s*z;
+  dir[ind2] = -s*y + c*z;
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// rotates the field such that its direction dir points along component 0. The
+// rotations are linear, so the direction of the rotated field is the rotated
+// direction and does not need another sweep.
 void rotate_phi_field (mdp_field<std::array<double, 4> >& phi, mdp_site& x,
-                       const double V) {
+                       std::array<double, 4> dir) {
 
   double angle;
-  std::array<double, 4> dir;
 
-  get_phi_field_direction (phi, x, dir, V);
   angle = get_angle (dir[1], dir[0]);
   rotate_phi_field_component (phi, x, 1, 0, -angle);
+  rotate_direction (dir, 1, 0, -angle);
 
-  get_phi_field_direction (phi, x, dir, V);
   angle = get_angle (dir[2], dir[0]);
   rotate_phi_field_component (phi, x, 2, 0, -angle);
+  rotate_direction (dir, 2, 0, -angle);
 
-  get_phi_field_direction (phi, x, dir, V);
   angle = get_angle (dir[3], dir[0]);
   rotate_phi_field_component (phi, x, 3, 0, -angle);
 
+}
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void rotate_phi_field (mdp_field<std::array<double, 4> >& phi, mdp_site& x,
+                       const double V) {
+
+  std::array<double, 4> dir;
+  get_phi_field_direction (phi, x, dir, V);
+  rotate_phi_field (phi, x, dir);
+
 }
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -410,177 +379,487 @@ int main(int argc, char** argv) {
   mdp_field<std::array<double, 4> > phi(hypercube); // declare phi field
   mdp_site x(hypercube); // declare lattice lookuptable
 
+  // structure-of-arrays copy of phi on which the updates run, together with
+  // its counter-based random numbers. With chains > 1 the chains live in a
+  // ChainBundle, which runs their Metropolis sweeps in lockstep, and phi_soa
+  // holds one chain at a time for the cluster update and the measurements
+  const bool soa = (params.data.field_backend == "soa");
+  const size_t nb_chains = params.data.chains;
+  const bool lockstep = (nb_chains > 1);
+  cluster::PhiField phi_soa(phi, x);
+  cluster::ChainBundle bundle(phi_soa, lockstep ? nb_chains : 0);
+  std::vector<cluster::LatticeDataContainer> chains;
+  std::vector<cluster::RandomStreams> streams;
+  for(size_t k = 0; k < nb_chains; k++){
+    chains.push_back(params.chain(k));
+    streams.emplace_back(chains[k].seed, chains[k].replica);
+  }
+  const cluster::metropolis_kernel_t kernel = 
+              cluster::get_metropolis_kernel(params.data.metropolis_kernel);
+  const int threads = cluster::init_threads(params.data.threads);
+  mdp << "\tupdating with " << threads << " thread(s) per process" << endl;
+  if(lockstep)
+    mdp << "\t" << nb_chains << " chains in lockstep" << endl;
+  // with swap_every_X_updates > 0 the chains are the walkers of a parallel 
+  // tempering ladder: chain k holds the couplings of slot ladder.slot(k), 
+  // measurements and checkpoints belong to the slot
+  const bool tempering = (params.data.swap_every_X_updates > 0);
+  cluster::ReplicaExchange ladder(params.data.chain_kappa, 
+                                  params.data.chain_lambda, params.data.seed, 
+                                  params.data.replica, 
+                                  params.data.swap_every_X_updates);
+#ifdef FLOAT_FIELD
+  if(soa)
+    mdp << "\tsoa field stored in single precision" << endl;
+#endif
+  const bool swendsen_wang = (params.data.cluster_algorithm == "swendsen_wang");
+  cluster::SwendsenWang sw(phi_soa, x);
+  cluster::ClusterWorkspace workspace(phi_soa.local_volume());
+
   // initialise the random number generator
   mdp_random.initialize(params.data.seed);
 
-  // random start configuration
-  forallsites(x)
-    phi(x) = create_phi_update(1.); 
-    
-  // compute magnetisation on start config
-  rotate_phi_field(phi, x, double(V));
-  double M = compute_magnetisation(phi, x);
-  mdp.add(M);
-  mdp << "\n\n\tmagnetization at start = " << M/V << endl;
-
-  // creating output file names and files *************************************
-  std::string file_ending = ".X" + std::to_string(params.data.L[1]) +
-                            ".Y" + std::to_string(params.data.L[2]) +
-                            ".Z" + std::to_string(params.data.L[3]) +
-                            ".kap" + std::to_string(params.data.kappa) + 
-                            ".lam" + std::to_string(params.data.lambda) + 
-                            ".rep_" + std::to_string(params.data.replica) + 
-                            ".dat";
-  std::string mag_file = params.data.outpath + "/mag.T" + 
-                         std::to_string(params.data.L[0]) + file_ending;
-  std::string HiggsProp_file = params.data.outpath + "/HiggsPropagator.T" + 
-                               std::to_string(params.data.L[0]) + file_ending;
-  std::string GoldstoneProp_file = params.data.outpath + "/GoldstonePropagator.T" + 
-                                   std::to_string(params.data.L[0]) + file_ending;
-  FILE *f_mag = fopen(mag_file.c_str(), "w"); 
-  FILE *f_Higgs = fopen(HiggsProp_file.c_str(), "wb"); 
-  FILE *f_Goldstone = fopen(GoldstoneProp_file.c_str(), "wb"); 
-  if (f_mag == NULL || f_Higgs == NULL || f_Goldstone == NULL) {
-      cout << params.data.outpath << endl;
-      printf("Error opening data file for mag or props\n");
-      exit(1);
-  }
-  
+  // configurations are saved per chain, the replica is part of the name as
+  // soon as there are several chains
+  auto conf_name = [&](const cluster::LatticeDataContainer& chain, 
+                       const int iteration){
+    return params.data.outpath + 
+           "/T" + std::to_string(params.data.L[0]) +
+           ".X" + std::to_string(params.data.L[1]) +
+           ".Y" + std::to_string(params.data.L[2]) +
+           ".Z" + std::to_string(params.data.L[3]) +
+           ".kap" + std::to_string(chain.kappa) + 
+           ".lam" + std::to_string(chain.lambda) +
+           (lockstep ? ".rep_" + std::to_string(chain.replica) : "") +
+           ".conf" + std::to_string(iteration);
+  };
+
   // Propagator initiation ****************************************************
-  // ini FFT by creating a plan at first
-  int howmanyFFTs = 5;
-  fftw_complex* output = new fftw_complex[5*V]; 
- 
-  int n[4],inembed[4],onembed[4];
-  for (int j = 0; j < 4; j++){
-    n[j] = params.data.L[j];
-    inembed[j] = params.data.L[j];
-    onembed[j] = params.data.L[j];
-  }
-  
-  fftw_plan Plan = fftw_plan_many_dft(4, n, 5, &(output[0]), inembed, 5, 1,
-	   		                              &(output[0]), onembed, 5, 1,
-	  			                            FFTW_FORWARD, FFTW_MEASURE);
-  
-  // create a list of \sum sin^2(P/2)
-  std::vector<double> sinPSqr(V);
-  std::vector<double> DifferentMomenta(V);
-  std::array<double,4> p;
-  int ctr = 0;
-  int SlotCnt = 0;
-  for (int x0 = 0; x0 < params.data.L[0]; x0++){
-  p[0] = x0*M_PI/L[0]; // half-momentum
-    for (int x1 = 0; x1 < params.data.L[1]; x1++){
-    p[1] = x1 * M_PI/L[1];
-      for (int x2 = 0; x2 < params.data.L[2]; x2++){
-      p[2] = x2 * M_PI/L[2];
-        for (int x3 = 0; x3 < params.data.L[3]; x3++){
-        p[3] = x3 * M_PI/L[3];
-        
-        sinPSqr[ctr] = 4.0 * ( sin(p[0])*sin(p[0]) + sin(p[1])*sin(p[1]) +
-                               sin(p[2])*sin(p[2]) + sin(p[3])*sin(p[3]) );
-        
-        int flag = Flag(sinPSqr[ctr], SlotCnt, DifferentMomenta);
-        
-        if (flag < 0){
-          DifferentMomenta[SlotCnt] = sinPSqr[ctr];
-          SlotCnt++;
-        }
-         
-        ctr++;
-        }
+  // real-to-complex FFT of the projections, distributed over the processes,
+  // and the index from every momentum to its distinct value of 
+  // \sum sin^2(P/2) - plans and bins are shared by all chains
+  cluster::PropagatorFFT fft(L, phi_soa, params.data.outpath);
+  const cluster::MomentumBins& momentum_bins = fft.momentum_bins();
+  mdp << "\n\n\tThere are " << momentum_bins.size() 
+      << " distinct momenta in the end." << endl;
+  const uint32_t nb_momenta = momentum_bins.size();
+
+  std::vector<std::unique_ptr<cluster::ObservableFile> > observables;
+  int first_iteration = 0;
+  double M;
+  for(size_t k = 0; k < nb_chains; k++){
+    const cluster::LatticeDataContainer& chain = chains[k];
+
+    // random start configuration
+    if(soa){
+      random_start(phi_soa, streams[k], 1.);
+      phi_soa.store();
+    }
+    else
+      forallsites(x)
+        phi(x) = create_phi_update(1.); 
+      
+    // compute magnetisation on start config
+    if(soa){ // from the running sums, the rotation keeps the length
+      rotate_phi_field(phi, x, phi_soa.global_sums().phi);
+      phi_soa.load();
+      M = phi_soa.magnetisation();
+    }
+    else{
+      rotate_phi_field(phi, x, double(V));
+      M = compute_magnetisation(phi, x);
+      mdp.add(M);
+    }
+    mdp << "\n\n\tmagnetization at start = " << M/V << endl;
+
+    // restart from a checkpoint: field, random state and running sums in one 
+    // file, the chain goes on where it was saved
+    int64_t conf_iteration = -1;
+    if(params.data.restart != 0){
+      std::string conf_file = conf_name(chain, params.data.restart);
+      std::string random_state;
+      if(!cluster::read_checkpoint(conf_file, phi_soa, L, conf_iteration, 
+                                   random_state) || random_state.empty()){
+        mdp << "Could not restart from " << conf_file << endl;
+        exit(1);
+      }
+      if(soa)
+        streams[k].set_state(random_state);
+      else
+        cluster::set_random_state(mdp_random, random_state, conf_file + 
+                                  ".random_state" + std::to_string(mdp.me()));
+      // all chains have to go on after the same iteration
+      if(k > 0 && conf_iteration + 1 != first_iteration){
+        mdp << "The checkpoints of the chains were written after different "
+            << "iterations, could not restart from " << conf_file << endl;
+        exit(1);
       }
+      first_iteration = conf_iteration + 1;
+      M = phi_soa.magnetisation();
+      mdp << "\trestarting after iteration " << conf_iteration 
+          << ", magnetization = " << M/V << endl;
+    }
+    if(lockstep)
+      bundle.load(k);
+
+    // creating the output file ***********************************************
+    // all observables of the chain in one binary file, its header holds the 
+    // parameters and the momenta of the propagators, after a restart the 
+    // records behind the checkpoint are dropped
+    std::string obs_file = params.data.outpath + 
+                           "/observables_with_Prop.T" + std::to_string(params.data.L[0]) + 
+                           ".X" + std::to_string(params.data.L[1]) +
+                           ".Y" + std::to_string(params.data.L[2]) +
+                           ".Z" + std::to_string(params.data.L[3]) +
+                           ".kap" + std::to_string(chain.kappa) + 
+                           ".lam" + std::to_string(chain.lambda) + 
+                           ".rep_" + std::to_string(chain.replica) + 
+                           ".seed" + std::to_string(chain.seed) + ".bin";
+    observables.emplace_back(new cluster::ObservableFile(obs_file, chain,
+                                        {{"magnetisation", 1}, 
+                                         {"acceptance", 1},
+                                         {"cluster_size", 1}, 
+                                         {"higgs_propagator", nb_momenta},
+                                         {"goldstone_propagator", nb_momenta}},
+                                        momentum_bins.momenta(), 
+                                        conf_iteration));
+  }
+
+  // with autotune = yes the thermalisation sweeps of a new run tune delta and
+  // the hits, see autotune.h; a restart takes the values written then
+  const bool autotune = (params.data.autotune == "yes");
+  cluster::AutoTuner tuner((autotune && params.data.restart == 0) ? 
+                           params.data.start_measure : 0,
+                           params.data.metropolis_delta, 
+                           params.data.metropolis_local_hits, 
+                           params.data.cluster_hits, 
+                           params.data.target_acceptance);
+  const std::string tune_file = params.data.outpath + 
+                           "/autotune_with_Prop.T" + 
+                           std::to_string(params.data.L[0]) +
+                           ".X" + std::to_string(params.data.L[1]) +
+                           ".Y" + std::to_string(params.data.L[2]) +
+                           ".Z" + std::to_string(params.data.L[3]) +
+                           ".rep_" + std::to_string(params.data.replica) + 
+                           ".seed" + std::to_string(params.data.seed) + 
+                           ".dat";
+  if(autotune && params.data.restart != 0){
+    if(!tuner.read(tune_file)){
+      mdp << "Could not read the tuned parameters from " << tune_file << endl;
+      exit(0);
     }
+    mdp << tuner.summary() << endl;
   }
-  DifferentMomenta.resize(SlotCnt);
-  printf("\n\n\tThere are %d distinct momenta in the end.\n",SlotCnt);
-  std::sort(DifferentMomenta.begin(), DifferentMomenta.end());
+
+  // checkpoints are written in the background, only the newest keep_configs
+  // of every chain are kept (all for 0)
+  cluster::CheckpointWriter checkpoints(L, 
+                                   params.data.config_compression == "fpc",
+                                   params.data.keep_configs);
+
+  std::vector<double> HiggsPropOut, GoldstonePropOut;
+  // streaming autocorrelation of |M| and of the zero mode of the Higgs 
+  // propagator of every chain (autocorrelation.h); the zero mode is added by 
+  // the measurements, which may run in the background. The Goldstone zero
+  // mode vanishes in the rotated field.
+  std::vector<cluster::BinningAnalysis> analysis(nb_chains), 
+                                        higgs_zero(nb_chains);
+  std::mutex zero_mode_mutex;
+  // wall clock time since the first measured iteration
+  cluster::wall_clock::time_point measure_begin;
+  auto measure_seconds = [&](){
+    return cluster::elapsed_seconds(cluster::wall_clock::now() - measure_begin);
+  };
+  // FFT, binning and output of all observables of one measurement
+  auto measure_propagators = [&](const size_t chain, const int iteration, 
+                                 const double mag, const double acc_rate, 
+                                 const double size){
+    cluster::profile().count(cluster::COUNTER_MEASUREMENTS);
+    fft.measure(HiggsPropOut, GoldstonePropOut);
+    {
+      std::lock_guard<std::mutex> lock(zero_mode_mutex);
+      higgs_zero[chain].add(HiggsPropOut[0]); // bin 0 is p^2 = 0
+    }
+    cluster::ObservableFile& out = *observables[chain];
+    out.record(iteration); // only written by process 0
+    out.put(mag);
+    out.put(acc_rate);
+    out.put(size);
+    out.put(HiggsPropOut);
+    out.put(GoldstonePropOut);
+  };
+  // with the soa backend they run on snapshots of the field in the 
+  // background while the chain goes on
+  cluster::MeasurementPipeline pipeline(soa ? params.data.measurement_queue : 0, 
+                                        [&](const cluster::Snapshot& snapshot){
+    cluster::ScopedTimer timer(cluster::TIMER_MEASUREMENT);
+    measure_projections(snapshot, chains[snapshot.chain].kappa, fft);
+    measure_propagators(snapshot.chain, snapshot.iteration, 
+                        snapshot.magnetisation()/V, snapshot.acceptance, 
+                        snapshot.cluster_size);
+  });
   
 
-  // The update ----------------------------------------------------------------
-  for(int ii = 0; ii < params.data.start_measure+params.data.total_measure; ii++) {
-
-    clock_t begin = clock(); // start time for one update step
-    // metropolis update
-    double acc = 0.0;
-    for(int global_metro_hits = 0; 
-        global_metro_hits < params.data.metropolis_global_hits; 
-        global_metro_hits++)
-      acc += metropolis_update(phi, x, params.data.kappa, params.data.lambda, 
-                               params.data.metropolis_delta, 
-                               params.data.metropolis_local_hits);
-    acc /= params.data.metropolis_global_hits;
-
-    // cluster update
+  // the steps of one iteration (update_schedule): the steps up to the last
+  // metropolis step run first, the others after it chain by chain together
+  // with the measurements
+  const std::vector<cluster::update_step_t> schedule = 
+                    cluster::get_update_schedule(params.data.update_schedule);
+  const int nb_metropolis = std::count(schedule.begin(), schedule.end(), 
+                                       cluster::STEP_METROPOLIS);
+  const int nb_cluster = std::count(schedule.begin(), schedule.end(), 
+                                    cluster::STEP_CLUSTER);
+  size_t tail = 0;
+  for(size_t s = 0; s < schedule.size(); s++)
+    if(schedule[s] == cluster::STEP_METROPOLIS)
+      tail = s + 1;
+  // hybrid Monte Carlo trajectories, only if the schedule has them (hmc.h)
+  std::unique_ptr<cluster::HybridMonteCarlo> hmc;
+  if(std::count(schedule.begin(), schedule.end(), cluster::STEP_HMC) > 0)
+    hmc.reset(new cluster::HybridMonteCarlo(L, phi_soa, params.data.outpath, 
+                        kernel, params.data.hmc_integrator == "leapfrog" ? 
+                        cluster::HMC_LEAPFROG : cluster::HMC_OMELYAN,
+                        params.data.hmc_steps, 
+                        params.data.hmc_trajectory_length,
+                        params.data.hmc_fourier_mass));
+  // an overrelaxation, heatbath, hmc or cluster step of chain k, which is in
+  // phi_soa (or phi), returns the summed cluster sizes
+  auto chain_step = [&](const cluster::update_step_t step, const size_t k){
+    const cluster::LatticeDataContainer& chain = chains[ladder.slot(k)];
     double cluster_size = 0.0;
-    for(size_t nb = 0; nb < params.data.cluster_hits; nb++)
-      cluster_size += cluster_update(phi, x, params.data.kappa, 
-                                     params.data.cluster_min_size);
-    cluster_size /= params.data.cluster_hits;
-
-    // compute observables every ZZZ configuration
-    if(ii > params.data.start_measure &&
-       ii%params.data.measure_every_X_updates == 0){
-       
-      mdp_field<std::array<double, 4> > phi_rot(phi); // copy field
-      rotate_phi_field(phi_rot, x, double(V)); 
-      M = compute_magnetisation(phi_rot, x);
-      mdp.add(M); // adding magnetisation and acceptance rate in parallel
-      mdp.add(acc);
-      fprintf(f_mag, "%.14lf\n", M/V);
-      fflush(f_mag);      
-      
+    if(step == cluster::STEP_OVERRELAXATION)
+      cluster::overrelaxation_update(phi_soa, streams[k], chain.kappa, 
+                                     chain.lambda);
+    else if(step == cluster::STEP_HEATBATH)
+      cluster::heatbath_update(phi_soa, streams[k], chain.kappa, chain.lambda);
+    else if(step == cluster::STEP_HMC)
+      hmc->trajectory(phi_soa, streams[k], chain.kappa, chain.lambda);
+    else
+      for(int nb = 0; nb < tuner.cluster_hits(); nb++)
+        if(swendsen_wang)
+          cluster_size += sw.update(phi_soa, streams[k], chain.kappa);
+        else if(soa)
+          cluster_size += cluster_update(phi_soa, workspace, streams[k], 
+                                         chain.kappa, 
+                                         params.data.cluster_min_size);
+        else
+          cluster_size += cluster_update(phi, x, params.data.kappa, 
+                                         params.data.cluster_min_size);
+    return cluster_size;
+  };
+
+  // wall clock timers and counters of the update loop, see instrumentation.h,
+  // written every profile_every_X_updates iterations and at the end
+  const std::string profile_file = params.data.outpath + 
+                           "/profile_with_Prop.T" + std::to_string(params.data.L[0]) +
+                           ".X" + std::to_string(params.data.L[1]) +
+                           ".Y" + std::to_string(params.data.L[2]) +
+                           ".Z" + std::to_string(params.data.L[3]) +
+                           ".rep_" + std::to_string(params.data.replica) + 
+                           ".seed" + std::to_string(params.data.seed) + 
+                           ".json";
+  cluster::profile().reset();
 
-    	///// Propagator working zone
-    	// get re-scaled field.
-    	mdp_field< std::array<double, 4> > phi_rescale(phi);
-            Rescale(phi_rescale, phi, x, 2*params.data.kappa);
-    	
-    	// get projected modes
-    	Projection(phi_rescale, x, output);
-            
-    	// execute plan
-    	fftw_execute(Plan);
-    	
-    	const int keep_components = 100;
-    	std::array<double,keep_components> HiggsPropOut, GoldstonePropOut;
-    	
-    	// computing components
-    	for (int j = 0; j < keep_components; j++){	
-    	  HiggsPropOut[j] = 
-          GetHiggsComponent(output, sinPSqr, DifferentMomenta, j, V);
-    	  GoldstonePropOut[j] = 
-          GetGoldstoneComponent(output, sinPSqr, DifferentMomenta, j, V);
-    	}
-      // writing data to file
-//      for (int l = 0; l < keep_components-1; l++){
-//        fprintf(f_Higgs, "%.14lf ", HiggsPropOut[l]);
-//        fprintf(f_Goldstone, "%.14lf ", GoldstonePropOut[l]);
-//      }
-//      fprintf(f_Higgs, "%.14lf \n", HiggsPropOut[keep_components-1]);
-//      fprintf(f_Goldstone, "%.14lf \n", GoldstonePropOut[keep_components-1]);
-
-      fwrite(&HiggsPropOut[0], sizeof(double), keep_components, f_Higgs);
-      fflush(f_Higgs);
-      fwrite(&GoldstonePropOut[0], sizeof(double), keep_components, f_Goldstone);
-      fflush(f_Goldstone);
-
-      clock_t end = clock(); // end time for one update step
-      mdp << ii << "\tmag after rot = " << M/V;
-      mdp << "  \tacc. rate = " << acc/V 
-          << "  \tcluster size = " << 100.*cluster_size/V 
-          << "\ttime for 1 update= " << double(end - begin) / CLOCKS_PER_SEC 
-          << endl;
-      fflush(stdout);	
-    }// end of cumputing observables
+  // The update ----------------------------------------------------------------
+  for(int ii = first_iteration; 
+      ii < params.data.start_measure+params.data.total_measure; ii++) {
+
+    const auto begin = cluster::wall_clock::now(); // start time for one update step
+    if(ii == std::max(first_iteration, params.data.start_measure + 1))
+      measure_begin = cluster::wall_clock::now();
+    const bool tuning = tuner.tuning();
+    // the steps up to the last metropolis step, metropolis on all chains at
+    // once, the others chain by chain
+    std::vector<double> acc(nb_chains, 0.0), cluster_size(nb_chains, 0.0);
+    for(size_t s = 0; s < tail; s++)
+      if(schedule[s] == cluster::STEP_METROPOLIS)
+        for(int global_metro_hits = 0; 
+            global_metro_hits < params.data.metropolis_global_hits; 
+            global_metro_hits++)
+          if(lockstep)
+            metropolis_update(bundle, streams, kernel, ladder.kappa(),
+                              ladder.lambda(), 
+                              tuner.delta(), 
+                              tuner.local_hits(), acc);
+          else if(soa)
+            acc[0] += metropolis_update(phi_soa, streams[0], kernel, 
+                                        params.data.kappa, params.data.lambda, 
+                                        tuner.delta(), 
+                                        tuner.local_hits());
+          else
+            acc[0] += metropolis_update(phi, x, params.data.kappa, 
+                                        params.data.lambda, 
+                                        tuner.delta(), 
+                                        tuner.local_hits());
+      else
+        for(size_t k = 0; k < nb_chains; k++){
+          if(lockstep)
+            bundle.store(k);
+          cluster_size[k] += chain_step(schedule[s], k);
+          if(lockstep)
+            bundle.load(k);
+        }
+    if(nb_metropolis > 0)
+      for(auto& a : acc)
+        a /= params.data.metropolis_global_hits*nb_metropolis;
+    // what the tuner needs: acceptance, |M| and wall clock time of the updates
+    std::vector<double> rate(acc), mag(nb_chains, 0.);
+    double seconds = cluster::elapsed_seconds(cluster::wall_clock::now() - begin);
+
+    // the remaining steps and the measurements chain by chain
+    for(size_t k = 0; k < nb_chains; k++){
+      const size_t slot = ladder.slot(k);
+      const auto cluster_begin = cluster::wall_clock::now();
+      if(lockstep)
+        bundle.store(k);
+
+      for(size_t s = tail; s < schedule.size(); s++)
+        cluster_size[k] += chain_step(schedule[s], k);
+      if(nb_cluster > 0)
+        cluster_size[k] /= nb_cluster*tuner.cluster_hits();
+      if(tuning){
+        mag[k] = phi_soa.magnetisation()/V;
+        seconds += cluster::elapsed_seconds(cluster::wall_clock::now() - 
+                                            cluster_begin);
+      }
+
+      // compute observables every ZZZ configuration
+      if(ii > params.data.start_measure &&
+         ii%params.data.measure_every_X_updates == 0){
+        cluster::Snapshot* snapshot = NULL;
+        if(soa){ // the magnetisation comes with the snapshot
+          snapshot = &pipeline.acquire();
+          snapshot->take(phi_soa);
+          M = snapshot->magnetisation();
+        }
+        else{
+          mdp_field<std::array<double, 4> > phi_rot(phi); // copy field
+          rotate_phi_field(phi_rot, x, double(V)); 
+          M = compute_magnetisation(phi_rot, x);
+          mdp.add(M); // adding magnetisation in parallel
+        }
+        mdp.add(acc[k]);
+        analysis[slot].add(M/V);
+
+
+      	///// Propagator working zone
+        if(soa){
+          snapshot->iteration = ii;
+          snapshot->chain = slot;
+          snapshot->acceptance = acc[k]/V;
+          snapshot->cluster_size = cluster_size[k]/V;
+          pipeline.submit(*snapshot);
+        }
+        else{
+          cluster::ScopedTimer timer(cluster::TIMER_MEASUREMENT);
+      	  // get re-scaled field.
+      	  mdp_field< std::array<double, 4> > phi_rescale(phi);
+          Rescale(phi_rescale, phi, x, 2*params.data.kappa);
+      	
+      	  // get projected modes
+      	  Projection(phi_rescale, x, fft);
+
+      	  // FFT and all distinct momenta in one pass over its output
+          measure_propagators(slot, ii, M/V, acc[k]/V, cluster_size[k]/V);
+        }
+
+        const auto end = cluster::wall_clock::now(); // end time for one update step
+        mdp << ii;
+        if(lockstep)
+          mdp << "\tchain " << slot;
+        if(tempering)
+          mdp << " walker " << k;
+        mdp << "\tmag after rot = " << M/V;
+        mdp << "  \tacc. rate = " << acc[k]/V 
+            << "  \tcluster size = " << 100.*cluster_size[k]/V 
+            << "\ttime for 1 update= " << cluster::elapsed_seconds(end - begin);
+        {
+          // effective samples of the slower of the two observables
+          std::lock_guard<std::mutex> lock(zero_mode_mutex);
+          const double effective = std::min(analysis[slot].effective_samples(),
+                                            higgs_zero[slot].effective_samples());
+          mdp << "\ttau_int = " << analysis[slot].tau_int() << " " 
+              << higgs_zero[slot].tau_int()
+              << "\teff/s = " << effective/measure_seconds() << endl;
+        }
+        fflush(stdout);	
+      }// end of cumputing observables
+      if(lockstep)
+        bundle.load(k);
+    }
+    if(tempering)
+      ladder.swap(bundle, ii);
+    // checkpoints after the swaps, so a restart continues the ladder exactly
+    if(params.data.save_config == "yes" && ii > params.data.start_measure &&
+       ii%params.data.save_config_every_X_updates == 0)
+      for(size_t k = 0; k < nb_chains; k++){
+        std::string conf_file = conf_name(chains[ladder.slot(k)], ii);
+        if(lockstep)
+          bundle.store(k);
+        if(!soa) // the configuration is written from the soa layout
+          phi_soa.load();
+        checkpoints.save(phi_soa, ii, 
+                         soa ? streams[k].state() : 
+                         cluster::random_state(mdp_random, conf_file + 
+                                  ".random_state" + std::to_string(mdp.me())),
+                         conf_file);
+      }
+    if(tuning){ // the same numbers on every process
+      for(auto& r : rate){
+        mdp.add(r);
+        r /= V;
+      }
+      mdp.add(seconds);
+      tuner.update(rate, mag, seconds/mdp.nproc());
+      if(!tuner.tuning()){
+        mdp << tuner.summary() << endl;
+        tuner.write(tune_file);
+      }
+    }
+    if(params.data.profile_every_X_updates > 0 &&
+       ii%params.data.profile_every_X_updates == 0)
+      cluster::profile().write_json(profile_file, ii);
   }// end of the update
   
   // end everything
-  fftw_destroy_plan(Plan);
-
-  fclose(f_Higgs);
-  fclose(f_Goldstone);
-  fclose(f_mag);
+  pipeline.finish(); // outstanding measurements
+  checkpoints.finish(); // outstanding checkpoints
+  for(auto& o : observables)
+    o->close();
+  cluster::profile().write_json(profile_file, 
+                       params.data.start_measure+params.data.total_measure-1);
+  const double seconds = measure_seconds();
+  for(size_t s = 0; s < nb_chains; s++){
+    const std::vector<std::pair<std::string, cluster::BinningAnalysis*> > 
+      summary = {{"|M|/V", &analysis[s]}, {"Higgs p=0", &higgs_zero[s]}};
+    for(const auto& a : summary)
+      if(a.second->size() > 0){
+        if(lockstep)
+          mdp << "\tchain " << s;
+        mdp << "\t" << a.first << " = " << a.second->mean() << " +- " 
+            << a.second->error() << ", tau_int = " << a.second->tau_int() 
+            << ", " << a.second->effective_samples() << " effective samples, "
+            << a.second->effective_samples()/seconds << " per second" << endl;
+      }
+  }
+  if(hmc)
+    mdp << hmc->summary() << endl;
+  if(tempering){
+    for(size_t s = 0; s + 1 < nb_chains; s++)
+      mdp << "\tswaps kappa " << chains[s].kappa << " <-> " 
+          << chains[s+1].kappa << ": acceptance " << ladder.acceptance(s) 
+          << endl;
+    mdp << "\t" << ladder.nb_round_trips() << " round trips, mean length " 
+        << ladder.mean_round_trip() << " iterations" << endl;
+    ladder.write_statistics(params.data.outpath + 
+                            "/tempering_with_Prop.T" + std::to_string(params.data.L[0]) +
+                            ".X" + std::to_string(params.data.L[1]) +
+                            ".Y" + std::to_string(params.data.L[2]) +
+                            ".Z" + std::to_string(params.data.L[3]) +
+                            ".rep_" + std::to_string(params.data.replica) + 
+                            ".seed" + std::to_string(params.data.seed) + 
+                            ".dat");
+  }
 
   mdp.close_wormholes();
   return 0;